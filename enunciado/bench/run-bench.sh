@@ -0,0 +1,51 @@
+#! /bin/bash
+
+# Runs every workload in bench/workloads with every spawn backend and prints the
+# --bench report of each one. Run it from the enunciado directory, like test-wish.sh:
+#
+#   prompt> ./bench/run-bench.sh [-n runs] [-b "fork vfork posix_spawn"] [-w workload] [-N]
+#
+# The workloads are made of echo/true/cat, so by default wish runs them with
+# --no-native-utils and every command really goes through the spawn backend.
+
+runs=5
+backends="fork vfork posix_spawn"
+workloads=""
+native="--no-native-utils"
+
+usage () {
+    echo "usage: run-bench.sh [-h] [-n runs] [-b backends] [-w workload] [-N]"
+    echo "  -h                help message"
+    echo "  -n runs           times each workload is replayed (default 5)"
+    echo "  -b backends       space separated spawn backends to compare"
+    echo "  -w workload       run only bench/workloads/<workload>.in"
+    echo "  -N                let wish run echo/true/cat/test as native builtins"
+    return 0
+}
+
+while getopts "hn:b:w:N" opt; do
+    case "$opt" in
+    h) usage; exit 0;;
+    n) runs=$OPTARG;;
+    b) backends=$OPTARG;;
+    w) workloads=$OPTARG;;
+    N) native="";;
+    *) usage; exit 1;;
+    esac
+done
+
+if ! [[ -x wish ]]; then
+    echo "wish executable does not exist"
+    exit 1
+fi
+
+if [[ -z $workloads ]]; then
+    workloads=$(ls bench/workloads/*.in | xargs -n1 basename | sed 's/\.in$//')
+fi
+
+for workload in $workloads; do
+    for backend in $backends; do
+	./wish --spawn=$backend $native --bench=$runs bench/workloads/$workload.in > /dev/null
+	echo ""
+    done
+done
@@ -0,0 +1,169 @@
+#! /bin/bash
+
+# Load and scalability suite. Generates big workloads, runs them against ./wish and compares
+# the results with a baseline, failing when something got slower than the threshold allows.
+# Run it from the enunciado directory, like test-wish.sh (or through ./test-wish.sh -p):
+#
+#   prompt> ./bench/run-perf.sh -r        # record bench/baseline.txt with this build
+#   prompt> ./bench/run-perf.sh           # later build: compare against it
+#
+# Workloads (generated in a temporary directory):
+#   batch     10000 lines of single commands
+#   fanout    lines of 1000 '&' commands each
+#   longpath  a path of 500 directories in front of the real ones
+#   redirect  >, >>, <, 2> and 2>&1 on every line
+#
+# Every workload records:
+#   cmds_per_s   commands per second over the --bench replays (higher is better)
+#   line_p50_us  median latency of one input line (all its commands), from the --bench report
+#   line_p99_us  99th percentile of it
+#   maxrss_kb    peak RSS of one run, measured with ../time.c
+#   syscalls     system calls made by the shell itself in one run (needs strace)
+# Each metric is lower is better, except cmds_per_s.
+
+runs=3
+threshold=25
+baseline=bench/baseline.txt
+record=0
+workloads="batch fanout longpath redirect"
+native="--no-native-utils"
+
+usage () {
+    echo "usage: run-perf.sh [-h] [-n runs] [-t percent] [-f baseline] [-w workload] [-r] [-N]"
+    echo "  -h                help message"
+    echo "  -n runs           --bench replays of each workload (default 3)"
+    echo "  -t percent        allowed regression before failing (default 25)"
+    echo "  -f baseline       baseline file (default bench/baseline.txt)"
+    echo "  -w workload       run only this workload (batch, fanout, longpath, redirect)"
+    echo "  -r                record the results as the new baseline instead of comparing"
+    echo "  -N                let wish run echo/true/cat/test as native builtins"
+    return 0
+}
+
+while getopts "hn:t:f:w:rN" opt; do
+    case "$opt" in
+    h) usage; exit 0;;
+    n) runs=$OPTARG;;
+    t) threshold=$OPTARG;;
+    f) baseline=$OPTARG;;
+    w) workloads=$OPTARG;;
+    r) record=1;;
+    N) native="";;
+    *) usage; exit 1;;
+    esac
+done
+
+if ! [[ -x wish ]]; then
+    echo "wish executable does not exist"
+    exit 1
+fi
+
+work=$(mktemp -d /tmp/wish-perf.XXXXXX)
+trap 'rm -rf $work' EXIT
+
+# The profiler of the repository gives the peak RSS
+profiler=""
+if gcc -O2 -o $work/time ../time.c -lm 2> /dev/null; then
+    profiler=$work/time
+fi
+
+# generate workload file
+generate () {
+    local name=$1
+    local file=$work/$name.in
+    case "$name" in
+    batch)
+	yes true | head -n 10000 > $file;;
+    fanout)
+	local line=$(yes true | head -n 1000 | paste -s -d '&' | sed 's/&/ \& /g')
+	for i in 1 2 3 4 5; do echo "$line"; done > $file;;
+    longpath)
+	echo "path $(seq -f "$work/missing%g" 1 500 | paste -s -d ' ') /usr/bin /bin" > $file
+	for i in $(seq 1 500); do
+	    echo "true"; echo "false"; echo "echo path > /dev/null"; echo "test -d /"
+	done >> $file;;
+    redirect)
+	for i in $(seq 1 500); do
+	    echo "echo line $i > $work/r.out"
+	    echo "cat < $work/r.out >> $work/r.log"
+	    echo "wc -l < $work/r.log > /dev/null 2>&1"
+	    echo "ls $work/missing 2> /dev/null"
+	done > $file;;
+    *)
+	echo "unknown workload: $name" >&2; exit 1;;
+    esac
+}
+
+# measure workload: prints "workload metric value" lines
+measure () {
+    local name=$1
+    local file=$work/$name.in
+    local report=$(./wish $native --bench=$runs $file 2>&1 > /dev/null)
+
+    echo "$report" | awk -v w=$name '
+	$1 == "line" { print w, "line_p50_us", $5; print w, "line_p99_us", $7 }
+	$1 == "commands:" { print w, "cmds_per_s", $3 }'
+
+    if [[ -n $profiler ]]; then
+	$profiler -f csv -o $work/rss.csv ./wish $native $file > /dev/null 2>&1
+	awk -F, -v w=$name 'NR == 1 { for (i = 1; i <= NF; i++) if ($i == "maxrss_kb") c = i }
+	    NR == 2 { print w, "maxrss_kb", $c + 0 }' $work/rss.csv
+    fi
+
+    if command -v strace > /dev/null; then
+	strace -c -o $work/syscalls.txt ./wish $native $file > /dev/null 2>&1
+	# The columns differ between strace versions (and the total line leaves some empty):
+	# take the calls number from under its right-aligned header
+	awk -v w=$name '
+	    / calls / && $NF == "syscall" { end = index($0, " calls") + 6; start = end - 6
+		while (start > 1 && substr($0, start - 1, 1) == " ") start--; next }
+	    end > 0 && $NF == "total" { calls = substr($0, start, end - start); gsub(/ /, "", calls)
+		print w, "syscalls", calls }' $work/syscalls.txt
+    fi
+}
+
+results=$work/results.txt
+for workload in $workloads; do
+    generate $workload
+    echo -e "\e[33mrunning workload $workload\e[0m"
+    measure $workload | tee -a $results
+done
+[[ -n $profiler ]] || echo "maxrss_kb not measured: ../time.c did not build"
+command -v strace > /dev/null || echo "syscalls not measured: strace is not installed"
+
+if (( $record == 1 )); then
+    {
+	echo "# wish perf baseline, $(date -u '+%Y-%m-%d %H:%M:%S UTC'), $(uname -m), runs=$runs $native"
+	cat $results
+    } > $baseline
+    echo "baseline written to $baseline"
+    exit 0
+fi
+
+if [[ ! -f $baseline ]]; then
+    echo "no baseline in $baseline, record one with -r"
+    exit 1
+fi
+
+# compare with the baseline: a regression is a change past the threshold in the bad direction
+echo ""
+awk -v limit=$threshold '
+    FNR == NR { if ($1 !~ /^#/) base[$1 " " $2] = $3; next }
+    {
+	key = $1 " " $2
+	if (!(key in base) || base[key] == 0) { printf "%-10s %-11s %12s %12s\n", $1, $2, "-", $3; next }
+	change = ($3 - base[key]) * 100 / base[key]
+	worse = ($2 == "cmds_per_s") ? -change : change
+	status = worse > limit ? "\033[31mREGRESSION\033[0m" : ""
+	if (worse > limit) failed++
+	printf "%-10s %-11s %12s %12s %+8.1f%% %s\n", $1, $2, base[key], $3, change, status
+    }
+    END { exit failed > 0 }' $baseline $results
+status=$?
+
+if (( $status != 0 )); then
+    builtin echo -e "\e[31mperf: regression over ${threshold}% against $baseline\e[0m"
+    exit 1
+fi
+builtin echo -e "\e[32mperf: within ${threshold}% of $baseline\e[0m"
+exit 0
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For pipe2(), splice() and tee()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,20 +8,183 @@
 #include <fcntl.h> // For open()
 #include <ctype.h> // For isspace()
 #include <stdbool.h> // to use bool type
+#include <sys/stat.h> // For stat() on PATH directories
+#include <spawn.h> // For posix_spawn()
+#include <errno.h> // For EINTR
+#include <stdint.h>
+#include <sys/mman.h> // For mmap() of scripts and compiled scripts
+#include <limits.h> // For PATH_MAX
+#include <time.h> // For clock_gettime()
+#include <pthread.h> // For the trace flusher thread
+#include <stdatomic.h> // For the lock-free trace ring
+#include <sys/epoll.h> // For reaping background jobs
+#include <sys/syscall.h> // For SYS_pidfd_open
+#include <sys/sendfile.h> // For writing out captured output
+#include <sys/uio.h> // For writev()
+#include <sys/socket.h> // For --serve
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/prctl.h> // For PR_SET_PDEATHSIG of zygote helpers
+#include <signal.h>
+#include <alloca.h>
+#include <sys/resource.h> // For the ulimit and limit builtins
+#include <sched.h>
+#include <termios.h> // For the line editor
+#include <dirent.h> // For Tab completion
+#include <sys/ioctl.h> // For the terminal width
+#include <glob.h> // For parallel -g
+#include <fnmatch.h> // For glob expansion
 
 
-#define MAX_LINE 1024 // Max input line size
-
 // Global debug mode flag
 int debug_mode = 0;
 
+// Available ways of starting a child process, selected with --spawn
+typedef enum {
+    SPAWN_FORK,        // fork() + execv()
+    SPAWN_VFORK,       // vfork() + execv()
+    SPAWN_POSIX_SPAWN, // posix_spawn() with file actions
+    SPAWN_ZYGOTE       // Handed to a pre-forked helper, see ZYGOTE POOL
+} SpawnBackend;
+
+SpawnBackend spawn_backend = SPAWN_FORK;
+
+// Command tree produced by parse_line() for every input line, allocated in the line arena
+
+// Kinds of redirection a command can carry
+typedef enum {
+    REDIRECT_OUT,         // 'N>' file, created or truncated
+    REDIRECT_APPEND,      // 'N>>' file, created or appended to
+    REDIRECT_IN,          // 'N<' file, read
+    REDIRECT_DUP,         // 'N>&M': fd N becomes a copy of fd M
+    REDIRECT_HERE_STRING  // '<<<' word: stdin reads the word and a newline
+} RedirectType;
+
+#define REDIRECT_MAX_FD 9 // Highest fd a redirection can name, 'N' and 'M' are one digit
+
+typedef struct {
+    RedirectType type;
+    int fd;             // The fd redirected: 1 for '>' and '>>', 0 for '<' and '<<<' unless given
+    const char *target; // File name, here-string text, or the digit of M for REDIRECT_DUP
+} Redirect;
+
+// Standard stream setup of a spawned command
+typedef struct {
+    int stdinFd;          // fd to become stdin (pipeline stage, here-string), or -1 to inherit the shell's
+    int stdoutFd;         // fd to become stdout, or -1 to inherit
+    const Redirect *redirects; // Applied in the child after stdinFd/stdoutFd, in order, so they win
+    int redirectCount;
+} SpawnIO;
+
+// One stage of a pipeline: a program with its arguments and redirections
+typedef struct {
+    char **args;         // NULL terminated argument vector, args[0] is the program
+    int argCount;        // Number of entries in args (without the NULL)
+    Redirect *redirects; // Redirections in the order they were written
+    int redirectCount;
+    bool invalid;        // Set when the stage is malformed, e.g. "ls >" or "ls > a b"
+} SimpleCommand;
+
+// How a pipeline is chained to the next one of its and-or list
+typedef enum {
+    LINK_NONE, // Last (or only) pipeline of the list
+    LINK_AND,  // '&&': the next one runs if this one succeeded
+    LINK_OR    // '||': the next one runs if this one failed
+} PipelineLink;
+
+// One or more stages connected with '|'. Pipelines chained with '&&'/'||' form an and-or list,
+// and the and-or lists are what '&' separates
+typedef struct Pipeline {
+    SimpleCommand *stages;
+    int stageCount;
+    bool invalid;        // Set when a stage is empty, e.g. "ls | | wc", or "&&" misses a side
+    bool usesStatus;     // A word contains "$?", expanded right before the pipeline runs
+    bool usesGlob;       // An argument is a pattern ('*', '?', '[...]'), expanded then too
+    PipelineLink link;
+    struct Pipeline *next; // Pipeline after the '&&'/'||', NULL with LINK_NONE
+} Pipeline;
+
+// A whole input line, the and-or lists that have to run in parallel (by their first pipeline)
+typedef struct {
+    Pipeline *commands;
+    int commandCount;
+    bool background;     // Line ended with '&', a background job under --background
+} CommandLine;
+
+extern char **environ; // Passed to posix_spawn as the child environment
+
+// Max number of '&' commands running at once, 0 means no limit (--max-jobs)
+int max_parallel_jobs = 0;
+
+// How the stdout of '&' commands reaches ours, selected with --parallel-output
+typedef enum {
+    OUTPUT_DIRECT,   // Every command writes straight to our stdout, interleaved
+    OUTPUT_ORDERED,  // Captured in a memfd per command, written out in command order
+    OUTPUT_PREFIX    // Captured, written out as each command finishes with lines tagged "[N] "
+} ParallelOutput;
+
+ParallelOutput parallel_output = OUTPUT_DIRECT;
+
+// When set, bare `cat` and `tee FILE` pipeline stages run inside the shell with splice()
+int splice_fast_path = 1;
+
+// When set, batch scripts are compiled once and later runs execute the cached binary form
+int compile_cache = 0;
+const char *compile_cache_dir = NULL; // NULL means $XDG_CACHE_HOME/wish or ~/.cache/wish
+
+// When set (--incremental), commands writing a file with '>' are skipped if their inputs didn't
+// change since they made it, see INCREMENTAL MODE
+int incremental = 0;
+const char *incremental_dir = NULL; // Same default as compile_cache_dir
+
+// When set (--bench), every phase of command execution is timed, see BENCHMARK PROBES
+int bench_mode = 0;
+int bench_stop_iteration = 0; // Set by `exit` while benchmarking, ends the current run only
+
+// When set, cached PATH lookups are revalidated against the directory mtimes
+int hash_revalidate = 0;
+
+// When set (--trace=FILE), every probe also records a trace event, see TRACE RING
+int trace_enabled = 0;
+
+// When set (--parallel-script), independent lines of a batch script run at the same time
+int parallel_script = 0;
+
+// When set, echo, true, false, cat and test run inside the shell instead of fork + exec
+// (--no-native-utils turns them off for strict compatibility)
+int native_utilities = 1;
+int builtin_status = 0; // Exit status of the last builtin
+int last_status = 0;    // Exit status of the last command line, what --serve reports
+
+// When set (--background), a line ending in '&' runs as a job and the shell reads on, see BACKGROUND JOBS
+int background_jobs = 0;
+
 ////////#########////////  FUNCTION PROTOTYPES  ////////#########////////
 
 
-void execute_external_command(char **args);
-void handle_redirection(char **args, int *arg_count);
-void execute_commands_in_parallel(char **commands, int num_commands);
-void parse_command_to_args(char *command, char **args);
+char* findExecutable(char* command);
+void execute_command(Pipeline *command);
+void execute_and_or(Pipeline *command);
+void execute_pipeline(Pipeline *pipeline);
+void execute_commands_in_parallel(CommandLine *line);
+int copy_stream(int inFd, int outFd, int teeFd);
+void process_command(const char *line, size_t len);
+void trace_emit(int phase, uint64_t start, uint64_t duration, int64_t arg);
+int start_parallel_command(Pipeline *command, pid_t *pids, int outFd);
+void job_start(CommandLine *line);
+bool job_child_exited(pid_t pid, int status);
+int builtin_parallel(char **args, int arg_count);
+int jobs_reap(int timeoutMs);
+void jobs_print();
+bool jobs_wait_one(int id);
+void jobs_wait_all();
+pid_t spawn_with_zygote(const char *path, char **args, const SpawnIO *io);
+void zygote_refill();
+void glob_cache_reset();
+bool word_has_glob(const char *word);
+const char* incremental_output(SimpleCommand *cmd);
+bool incremental_check(SimpleCommand *cmd, const char *output, uint64_t *fingerprint);
+void incremental_record(const char *output, uint64_t fingerprint);
 
 
 ////////#########////////  END FUNCTION PROTOTYPES  ////////#########////////
@@ -40,482 +204,6432 @@ int count_args(char **args) {
     return count;
 }
 
-// helper funct to parse command to args
-void parse_command_to_args(char *command, char **args) {
-    int i = 0;
-    char *token;
-    while ((token = strsep(&command, " \t\n")) != NULL) {
-        if (strlen(token) > 0) {
-            args[i++] = token;
+
+
+// Exit code of a waitpid() status, 128 + signal number for killed processes like other shells
+int exit_code(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+
+
+////////#########//////// END HELPER FUNCTIONS  ////////#########////////
+
+
+
+
+
+////////#########////////  BENCHMARK PROBES  ////////#########////////
+
+
+// Phases of running a command that --bench measures and --trace records
+typedef enum {
+    PHASE_PARSE,    // parse_line() of one input line
+    PHASE_LOOKUP,   // findExecutable() of one command
+    PHASE_SPAWN,    // spawn_process() until the parent gets the child pid back
+    PHASE_WAIT,     // one waitpid() call
+    PHASE_LINE,     // process_command(): parse and run one whole input line
+    PHASE_PIPELINE, // execute_pipeline() until every stage exited
+    PHASE_PARALLEL, // execute_commands_in_parallel() until every command exited
+    PHASE_COUNT
+} BenchPhase;
+
+const char *benchPhaseNames[PHASE_COUNT] = { "parse", "lookup", "spawn", "wait", "line", "pipeline", "parallel" };
+
+
+// Every sample of one phase, in nanoseconds
+typedef struct {
+    uint64_t *samples;
+    size_t count;
+    size_t capacity;
+} BenchSamples;
+
+
+BenchSamples benchSamples[PHASE_COUNT];
+uint64_t benchCommands = 0; // Simple commands (pipeline stages) executed while benchmarking
+
+
+
+// Monotonic clock in nanoseconds
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+// Start/stop a measurement. `arg` is a phase specific detail kept in the trace (a pid, a count).
+// When neither --bench nor --trace is on this is a single branch on two globals
+#define PROBE_START() ((bench_mode | trace_enabled) ? now_ns() : 0)
+#define PROBE_END(phase, start, arg) \
+    do { if (bench_mode | trace_enabled) probe_record((phase), (start), (arg)); } while (0)
+
+
+
+void bench_record(BenchPhase phase, uint64_t elapsed) {
+    BenchSamples *samples = &benchSamples[phase];
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->samples = realloc(samples->samples, samples->capacity * sizeof(uint64_t));
+        if (samples->samples == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    samples->samples[samples->count++] = elapsed;
+}
+
+
+
+// Hands a finished measurement to whichever consumers are enabled
+void probe_record(BenchPhase phase, uint64_t start, int64_t arg) {
+    uint64_t elapsed = now_ns() - start;
+    if (bench_mode) bench_record(phase, elapsed);
+    if (trace_enabled) trace_emit(phase, start, elapsed, arg);
+}
+
+
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+
+
+// Value at the given percentile of a sorted array (nearest rank)
+uint64_t percentile(const uint64_t *sorted, size_t count, double pct) {
+    if (count == 0) return 0;
+    size_t rank = (size_t)(pct / 100.0 * count + 0.5);
+    if (rank == 0) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+
+
+// Prints count, mean and percentiles (in microseconds) of a set of samples
+void print_bench_row(const char *name, uint64_t *samples, size_t count) {
+    if (count == 0) {
+        fprintf(stderr, "  %-10s %8d\n", name, 0);
+        return;
+    }
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    double total = 0;
+    for (size_t i = 0; i < count; i++) total += samples[i];
+    fprintf(stderr, "  %-10s %8zu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", name, count,
+            total / count / 1000.0,
+            samples[0] / 1000.0,
+            percentile(samples, count, 50) / 1000.0,
+            percentile(samples, count, 90) / 1000.0,
+            percentile(samples, count, 99) / 1000.0,
+            samples[count - 1] / 1000.0);
+}
+
+
+
+////////#########////////  END BENCHMARK PROBES  ////////#########////////
+
+
+
+
+
+////////#########////////  TRACE RING  ////////#########////////
+
+
+#define TRACE_RING_SIZE 65536    // Events buffered between flushes, a power of two
+#define TRACE_FLUSH_INTERVAL_MS 20 // How often the flusher thread drains the ring
+#define TRACE_WRITE_BUFFER 65536 // Formatted JSON written per write() call
+
+
+// One probe measurement, exactly as the shell recorded it
+typedef struct {
+    _Atomic uint64_t ready; // Position + 1 once the event below is complete
+    uint64_t start;    // CLOCK_MONOTONIC ns
+    uint64_t duration; // ns
+    int32_t pid;       // Process that recorded the event
+    int32_t tid;       // Thread that recorded it
+    int32_t phase;     // BenchPhase
+    int64_t arg;       // Phase specific detail, see traceArgNames
+} TraceEvent;
+
+
+// Multi producer (the shell and every child it forks) / single consumer (the flusher thread)
+// ring in MAP_SHARED memory, so sub-shells and builtin children record into the same one. A
+// producer claims a slot by moving head and marks it ready when it is filled in; the flusher
+// stops at the first slot that isn't. Nobody blocks on it: when the flusher falls behind, new
+// events are counted as dropped instead
+typedef struct {
+    TraceEvent events[TRACE_RING_SIZE];
+    _Atomic uint64_t head;    // Next slot a producer claims
+    _Atomic uint64_t tail;    // Next slot the flusher reads
+    _Atomic uint64_t dropped; // Events lost because the ring was full
+} TraceRing;
+
+
+// What the arg of each phase means in the trace viewer
+const char *traceArgNames[PHASE_COUNT] = { "bytes", "found", "pid", "pid", "bytes", "stages", "commands" };
+
+
+TraceRing *traceRing = NULL;
+int traceFd = -1;           // --trace file, written only by the flusher thread
+pid_t traceOwner = 0;       // The shell itself; forked children never flush
+pid_t tracePid = 0;         // This process and thread, refreshed in every forked child
+pid_t traceTid = 0;
+uint64_t traceEpoch = 0;    // Trace timestamps are relative to this
+pthread_t traceThread;
+atomic_int traceStop = 0;   // Tells the flusher to drain one last time and exit
+
+
+
+// Records one event. Called from the probes on the hot path: a compare-and-swap, a few stores
+// and no syscall
+void trace_emit(int phase, uint64_t start, uint64_t duration, int64_t arg) {
+    uint64_t head = atomic_load_explicit(&traceRing->head, memory_order_relaxed);
+    do {
+        uint64_t tail = atomic_load_explicit(&traceRing->tail, memory_order_acquire);
+        if (head - tail >= TRACE_RING_SIZE) {
+            atomic_fetch_add_explicit(&traceRing->dropped, 1, memory_order_relaxed);
+            return;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&traceRing->head, &head, head + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    TraceEvent *event = &traceRing->events[head & (TRACE_RING_SIZE - 1)];
+    event->start = start;
+    event->duration = duration;
+    event->pid = tracePid;
+    event->tid = traceTid;
+    event->phase = phase;
+    event->arg = arg;
+    atomic_store_explicit(&event->ready, head + 1, memory_order_release); // Publish it
+}
+
+
+
+// pthread_atfork() child handler: events of the child carry its own pid
+void trace_after_fork() {
+    tracePid = getpid();
+    traceTid = syscall(SYS_gettid);
+}
+
+
+
+// write() all of `len` bytes, retrying on short writes
+void trace_write(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(traceFd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return; // Disk full or similar, the trace is best effort
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+
+
+// Appends every event currently in the ring as Chrome trace "complete" (ph X) events. Only
+// integer formatting and write(): the shell may fork while this runs
+void trace_drain() {
+    static char buffer[TRACE_WRITE_BUFFER];
+    size_t used = 0;
+
+    uint64_t tail = atomic_load_explicit(&traceRing->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&traceRing->head, memory_order_acquire);
+    while (tail != head) {
+        const TraceEvent *event = &traceRing->events[tail & (TRACE_RING_SIZE - 1)];
+        if (atomic_load_explicit(&event->ready, memory_order_acquire) != tail + 1) break; // Being written
+        uint64_t ts = event->start - traceEpoch;
+
+        // Trace viewers take microseconds, keep the nanoseconds as decimals
+        int n = snprintf(buffer + used, sizeof(buffer) - used,
+                         ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,"
+                         "\"pid\":%d,\"tid\":%d,\"args\":{\"%s\":%lld}}",
+                         benchPhaseNames[event->phase],
+                         (unsigned long long)(ts / 1000), (unsigned long long)(ts % 1000),
+                         (unsigned long long)(event->duration / 1000),
+                         (unsigned long long)(event->duration % 1000),
+                         (int)event->pid, (int)event->tid, traceArgNames[event->phase],
+                         (long long)event->arg);
+        if (n < 0) break;
+        if ((size_t)n >= sizeof(buffer) - used) {
+            trace_write(buffer, used); // Buffer full, flush and format this event again
+            used = 0;
+            continue;
         }
+        used += n;
+        tail++;
+        atomic_store_explicit(&traceRing->tail, tail, memory_order_release); // Slot is free
     }
-    args[i] = NULL;
+    trace_write(buffer, used);
 }
 
 
-int is_line_empty_or_whitespace(const char* line) {
-    while (*line != '\0') {
-        if (!isspace((unsigned char)*line))
-            return 0; // Found a non-whitespace character
-        line++;
+
+// Flusher thread: drains the ring periodically, so the shell never waits on the trace file
+void* trace_flusher(void *unused) {
+    (void)unused;
+    struct timespec interval = { 0, TRACE_FLUSH_INTERVAL_MS * 1000000L };
+
+    while (!atomic_load(&traceStop)) {
+        trace_drain();
+        nanosleep(&interval, NULL);
     }
-    return 1; // Line is empty or all whitespace
+    trace_drain(); // Whatever was recorded before the stop
+    return NULL;
 }
 
 
-void split_commands(char* line, char*** commands, int* num_commands) {
-    int capacity = 10; // Initial capacity
-    *commands = malloc(capacity * sizeof(char*)); // Dynamically allocated array of command strings
-    if (*commands == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
+
+// atexit handler: stops the flusher and closes the JSON document
+void trace_finish() {
+    if (traceFd == -1 || getpid() != traceOwner) return; // Forked children don't own the file
+
+    trace_enabled = 0;
+    atomic_store(&traceStop, 1);
+    pthread_join(traceThread, NULL);
+
+    char footer[128];
+    int n = snprintf(footer, sizeof(footer), "\n],\"otherData\":{\"dropped\":%llu}}\n",
+                     (unsigned long long)atomic_load(&traceRing->dropped));
+    trace_write(footer, n);
+    close(traceFd);
+    traceFd = -1;
+}
+
+
+
+/**            ####     int trace_start(const char *path)    ####
+ * 
+ * Enables --trace: creates `path` and starts the flusher thread. From now on every
+ * PROBE_START/PROBE_END pair lands in the ring as one event (timestamp, pid, phase, duration
+ * and a phase specific arg), and the flusher appends it to the file in Chrome trace JSON, which
+ * chrome://tracing and ui.perfetto.dev open directly. The document is closed at exit.
+ * 
+ * The ring is shared memory, so children forked for builtins, and-or lists and the lines of
+ * --parallel-script record into it as well, each event with the pid and tid that produced it.
+ * Only the shell's own flusher drains it.
+ * 
+ * Returns:
+ *   0 on success, -1 if the file or the thread could not be created.
+ */
+int trace_start(const char *path) {
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    traceRing = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (traceFd == -1 || traceRing == MAP_FAILED) return -1;
+
+    traceOwner = getpid();
+    trace_after_fork(); // Not a fork, but the same setup for the shell itself
+    pthread_atfork(NULL, NULL, trace_after_fork);
+    traceEpoch = now_ns();
+
+    char header[128];
+    int n = snprintf(header, sizeof(header),
+                     "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                     "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"wish\"}}",
+                     (int)traceOwner);
+    trace_write(header, n);
+
+    if (pthread_create(&traceThread, NULL, trace_flusher, NULL) != 0) {
+        close(traceFd);
+        traceFd = -1;
+        return -1;
+    }
+    atexit(trace_finish);
+    trace_enabled = 1;
+    return 0;
+}
+
+
+////////#########////////  END TRACE RING  ////////#########////////
+
+
+
+
+
+////////#########////////  LINE ARENA  ////////#########////////
+
+
+#define ARENA_CHUNK_SIZE 4096 // Default size of an arena chunk, most lines fit in one
+
+
+// A block of memory handed out by the arena
+typedef struct ArenaChunk {
+    struct ArenaChunk *next; // Chunk allocated after this one
+    size_t size;             // Usable bytes in data
+    size_t used;             // Bytes already handed out
+    char data[];
+} ArenaChunk;
+
+
+// Bump allocator for everything the parser produces for one line. Nothing in it is freed
+// individually: arena_reset() drops it all at once after the line was executed
+typedef struct {
+    ArenaChunk *first;   // Kept across resets so steady state needs no malloc at all
+    ArenaChunk *current; // Chunk allocations are taken from
+} Arena;
+
+
+// global arena for the line being processed
+Arena lineArena;
+
+
+
+// Allocates a new chunk able to hold at least `minSize` bytes
+ArenaChunk* arena_new_chunk(size_t minSize) {
+    size_t size = minSize > ARENA_CHUNK_SIZE ? minSize : ARENA_CHUNK_SIZE;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    if (chunk == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed in arena_new_chunk\n");
         exit(EXIT_FAILURE);
     }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
 
-    *num_commands = 0;
-    char* token = strtok(line, "&");
-    while (token != NULL) {
-        if (*num_commands >= capacity) {
-            // Increase capacity
-            capacity *= 2;
-            *commands = realloc(*commands, capacity * sizeof(char*));
-            if (*commands == NULL) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(EXIT_FAILURE);
+
+
+// Returns `size` bytes of 8-byte aligned memory that live until the next arena_reset()
+void* arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (arena->current == NULL) {
+        arena->first = arena->current = arena_new_chunk(size);
+    }
+    while (arena->current->used + size > arena->current->size) {
+        if (arena->current->next == NULL) {
+            arena->current->next = arena_new_chunk(size);
+        }
+        arena->current = arena->current->next;
+        arena->current->used = 0;
+    }
+    void *memory = arena->current->data + arena->current->used;
+    arena->current->used += size;
+    return memory;
+}
+
+
+
+// Copies `len` bytes of `text` into the arena as a NUL terminated string
+char* arena_strndup(Arena *arena, const char *text, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+
+
+// Forget everything allocated since the last reset. Only the first chunk is kept,
+// a huge line doesn't pin its memory forever
+void arena_reset(Arena *arena) {
+    if (arena->first == NULL) return;
+    ArenaChunk *chunk = arena->first->next;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
+
+
+////////#########////////  END LINE ARENA  ////////#########////////
+
+
+
+
+
+////////#########////////  LINE PARSER  ////////#########////////
+
+
+// Linked list node used while a stage is still being read (the arg count isn't known yet)
+typedef struct WordNode {
+    char *text;
+    struct WordNode *next;
+} WordNode;
+
+
+// Parser state for the stage being read
+typedef struct {
+    WordNode *firstWord, *lastWord;
+    int wordCount;
+    Redirect redirects[REDIRECT_MAX_FD + 1]; // At most one per fd
+    int redirectCount;
+    unsigned redirectedFds; // Bit per fd that already has a redirection
+    Redirect pending;    // Operator waiting for its target
+    bool explicitFd;     // pending.fd was written before the operator, as in "2>"
+    bool expectTarget;   // Last token was a redirection operator, a target must follow
+    bool invalid;
+} StageBuilder;
+
+
+// Linked list node for finished stages/pipelines before they are laid out as arrays
+typedef struct ListNode {
+    void *item;
+    struct ListNode *next;
+} ListNode;
+
+
+
+// Lays out the words of a stage as an argv array and resets the builder
+void finish_stage(Arena *arena, StageBuilder *builder, SimpleCommand *stage) {
+    stage->args = arena_alloc(arena, (builder->wordCount + 1) * sizeof(char*));
+    stage->argCount = 0;
+    for (WordNode *word = builder->firstWord; word != NULL; word = word->next) {
+        stage->args[stage->argCount++] = word->text;
+    }
+    stage->args[stage->argCount] = NULL;
+
+    stage->redirectCount = builder->redirectCount;
+    stage->redirects = NULL;
+    if (builder->redirectCount > 0) {
+        stage->redirects = arena_alloc(arena, builder->redirectCount * sizeof(Redirect));
+        memcpy(stage->redirects, builder->redirects, builder->redirectCount * sizeof(Redirect));
+    }
+
+    // A redirection without a target, or without a command before it, is an error
+    stage->invalid = builder->invalid || builder->expectTarget ||
+                     (builder->redirectCount > 0 && builder->wordCount == 0);
+
+    memset(builder, 0, sizeof(*builder));
+}
+
+
+
+// Turns a list of items into an array of `itemSize` bytes each
+void* list_to_array(Arena *arena, ListNode *list, int count, size_t itemSize) {
+    char *array = arena_alloc(arena, count * itemSize + 1);
+    int i = 0;
+    for (ListNode *node = list; node != NULL; node = node->next) {
+        memcpy(array + (i++) * itemSize, node->item, itemSize);
+    }
+    return array;
+}
+
+
+
+/**            ####     CommandLine* parse_line(Arena *arena, const char *line, size_t len)    ####
+ * 
+ * Single-pass lexer/parser for one input line. Walks the characters once, splitting words on
+ * whitespace and on the operators '&', '&&', '|', '||' and the redirections '>', '>>', '<',
+ * '<<<', '>&' (so "ls>out" and "a&b" work without spaces), and builds the command tree directly
+ * (a single digit glued to a redirection is the fd it applies to, as in "2>err" or "2>&1"):
+ * 
+ *   CommandLine  - the and-or lists separated by '&', that run in parallel
+ *   Pipeline     - the stages separated by '|', chained to the next one by '&&' or '||'
+ *   SimpleCommand - argv plus redirections
+ * 
+ * Every word and node is allocated in `arena`, there's no per-token malloc and no limit on the
+ * number of arguments. The line itself is not modified.
+ * 
+ * Malformed stages and pipelines are not rejected here, they are flagged as invalid so the
+ * error is reported when (and only if) that command would run, like the old parser did. Empty
+ * commands (blank lines, a lone '&', trailing '&') are dropped; a trailing '&' only sets
+ * `background`, which matters under --background. A missing side of '&&' or '||' is kept as
+ * an invalid pipeline, so it fails when the list gets to it.
+ */
+CommandLine* parse_line(Arena *arena, const char *line, size_t len) {
+    CommandLine *parsed = arena_alloc(arena, sizeof(CommandLine));
+    ListNode *firstCommand = NULL, *lastCommand = NULL;
+    int commandCount = 0;
+
+    ListNode *firstStage = NULL, *lastStage = NULL;
+    int stageCount = 0;
+    bool sawPipe = false;
+    bool usesStatus = false;  // A word of the current pipeline contains "$?"
+    bool usesGlob = false;    // An argument of the current pipeline is a pattern
+    bool endsWithAmp = false; // Last operator or word of the line was '&'
+    Pipeline *listTail = NULL;            // Last pipeline of the current and-or list
+    PipelineLink pendingLink = LINK_NONE; // '&&' or '||' waiting for the pipeline after it
+    StageBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+
+    size_t i = 0;
+    while (true) {
+        bool atEnd = (i >= len);
+        char c = atEnd ? '\0' : line[i];
+
+        if (!atEnd && isspace((unsigned char)c)) {
+            i++;
+            continue;
+        }
+
+        if (atEnd || c == '&' || c == '|') {
+            // '&&' and '||' end the whole pipeline, like '&' but keep the and-or list going
+            PipelineLink link = LINK_NONE;
+            if (!atEnd && i + 1 < len && line[i + 1] == c) link = c == '&' ? LINK_AND : LINK_OR;
+
+            // End of a stage
+            bool emptyStage = builder.wordCount == 0 && builder.redirectCount == 0 && !builder.expectTarget;
+            SimpleCommand *stage = arena_alloc(arena, sizeof(SimpleCommand));
+            finish_stage(arena, &builder, stage);
+
+            ListNode *node = arena_alloc(arena, sizeof(ListNode));
+            node->item = stage;
+            node->next = NULL;
+            if (lastStage) lastStage->next = node; else firstStage = node;
+            lastStage = node;
+            stageCount++;
+
+            if (c == '|' && link == LINK_NONE) {
+                sawPipe = true;
+                endsWithAmp = false;
+                i++;
+                continue;
+            }
+
+            // End of a pipeline ('&', '&&', '||' or end of line). A single empty stage is no
+            // command at all, unless it is one side of '&&'/'||'
+            bool missingSide = link != LINK_NONE || pendingLink != LINK_NONE;
+            if (sawPipe || !emptyStage || missingSide) {
+                Pipeline *pipeline = arena_alloc(arena, sizeof(Pipeline));
+                pipeline->stageCount = stageCount;
+                pipeline->stages = list_to_array(arena, firstStage, stageCount, sizeof(SimpleCommand));
+                pipeline->invalid = !sawPipe && emptyStage; // "&& ls", "ls ||", "a && && b"
+                pipeline->usesStatus = usesStatus;
+                pipeline->usesGlob = usesGlob;
+                pipeline->link = LINK_NONE;
+                pipeline->next = NULL;
+                for (int s = 0; s < stageCount && sawPipe; s++) {
+                    if (pipeline->stages[s].argCount == 0 && pipeline->stages[s].redirectCount == 0) {
+                        pipeline->invalid = true; // Nothing between two '|'
+                    }
+                }
+
+                if (pendingLink != LINK_NONE) {
+                    // Continues the and-or list
+                    listTail->link = pendingLink;
+                    listTail->next = pipeline;
+                } else {
+                    ListNode *commandNode = arena_alloc(arena, sizeof(ListNode));
+                    commandNode->item = pipeline;
+                    commandNode->next = NULL;
+                    if (lastCommand) lastCommand->next = commandNode; else firstCommand = commandNode;
+                    lastCommand = commandNode;
+                    commandCount++;
+                }
+                listTail = pipeline;
+            }
+            firstStage = lastStage = NULL;
+            stageCount = 0;
+            sawPipe = false;
+            usesStatus = false;
+            usesGlob = false;
+            pendingLink = link;
+
+            if (atEnd) break;
+            endsWithAmp = link == LINK_NONE;
+            i += link == LINK_NONE ? 1 : 2;
+            continue;
+        }
+
+        endsWithAmp = false;
+        if (c == '>' || c == '<') {
+            // '>', '>>', '>&', '<', '<<<', the fd they apply to may have come right before
+            if (builder.expectTarget) builder.invalid = true; // Two operators in a row
+            Redirect *redirect = &builder.pending;
+            if (c == '>') {
+                redirect->type = REDIRECT_OUT;
+                if (i + 1 < len && line[i + 1] == '>') redirect->type = REDIRECT_APPEND;
+                if (i + 1 < len && line[i + 1] == '&') redirect->type = REDIRECT_DUP;
+                i += redirect->type == REDIRECT_OUT ? 1 : 2;
+            } else {
+                bool hereString = i + 2 < len && line[i + 1] == '<' && line[i + 2] == '<';
+                redirect->type = hereString ? REDIRECT_HERE_STRING : REDIRECT_IN;
+                i += hereString ? 3 : 1;
+            }
+            if (!builder.explicitFd) redirect->fd = c == '>' ? STDOUT_FILENO : STDIN_FILENO;
+            builder.explicitFd = false;
+            if (builder.redirectedFds & (1u << redirect->fd)) builder.invalid = true; // "ls > a > b"
+            builder.redirectedFds |= 1u << redirect->fd;
+            if (redirect->type == REDIRECT_HERE_STRING && redirect->fd != STDIN_FILENO) {
+                builder.invalid = true; // "3<<< word": a here-string only ever feeds stdin
             }
+            builder.expectTarget = true;
+            continue;
         }
-        
-        (*commands)[*num_commands] = strdup(token); // Duplicate and store the command
-        if ((*commands)[*num_commands] == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(EXIT_FAILURE);
+
+        // A word: runs until whitespace or an operator
+        size_t start = i;
+        while (i < len && !isspace((unsigned char)line[i]) &&
+               line[i] != '&' && line[i] != '|' && line[i] != '>' && line[i] != '<') {
+            i++;
+        }
+        if (i - start == 1 && isdigit((unsigned char)line[start]) && !builder.expectTarget &&
+            i < len && (line[i] == '>' || line[i] == '<')) {
+            builder.pending.fd = line[start] - '0'; // "2>": the fd of the operator that follows
+            builder.explicitFd = true;
+            continue;
+        }
+        char *word = arena_strndup(arena, line + start, i - start);
+        if (strstr(word, "$?") != NULL) usesStatus = true;
+
+        if (builder.expectTarget) {
+            Redirect *redirect = &builder.pending;
+            redirect->target = word;
+            if (redirect->type == REDIRECT_DUP && !(isdigit((unsigned char)word[0]) && word[1] == '\0')) {
+                builder.invalid = true; // '>&' takes a single digit fd
+            }
+            if (builder.redirectCount <= REDIRECT_MAX_FD) builder.redirects[builder.redirectCount++] = *redirect;
+            builder.expectTarget = false;
+        } else if (builder.redirectCount > 0) {
+            builder.invalid = true; // Extra word after the redirection target
+        } else {
+            if (word_has_glob(word)) usesGlob = true;
+            WordNode *node = arena_alloc(arena, sizeof(WordNode));
+            node->text = word;
+            node->next = NULL;
+            if (builder.lastWord) builder.lastWord->next = node; else builder.firstWord = node;
+            builder.lastWord = node;
+            builder.wordCount++;
         }
-        (*num_commands)++;
-        token = strtok(NULL, "&");
     }
+
+    parsed->commandCount = commandCount;
+    parsed->commands = list_to_array(arena, firstCommand, commandCount, sizeof(Pipeline));
+    parsed->background = endsWithAmp;
+    return parsed;
 }
 
 
+////////#########////////  END LINE PARSER  ////////#########////////
 
-////////#########//////// END HELPER FUNCTIONS  ////////#########////////
 
 
 
 
 
 
-////////#########//////// PATH HANDLING SHIT ////////#########//////// 
 
 
-// struct definition for global PATH
+////////#########//////// PATH HANDLING SHIT ////////#########//////// 
+
+
+// struct definition for global PATH
+typedef struct {
+    char **paths; // Array of strings
+    int count;    // Number of paths
+    int capacity; // Current capacity of the array
+} PathList;
+
+
+// global struct to store PATH
+PathList globalPathList;
+
+
+
+// Initialize the path list with a default size
+void initPathList(PathList *pathList, int capacity) {
+    pathList->paths = (char**)malloc(capacity * sizeof(char*));
+    // Check if malloc succeeded
+    if (pathList->paths == NULL) {
+        // Handle memory allocation failure
+        fprintf(stderr, "Error: Memory allocation failed in initPathList\n");
+        exit(EXIT_FAILURE); // Exit the program with a failure status
+    }
+    pathList->count = 0;
+    pathList->capacity = capacity;
+}
+
+
+
+
+// Free the memory used by the path list
+void freePathList(PathList *pathList) {
+    for (int i = 0; i < pathList->count; ++i) {
+        free(pathList->paths[i]); // Free each path string
+    }
+    free(pathList->paths); // Free the array of pointers
+}
+
+
+
+// Clears the current paths and reallocates the paths array
+void clearPaths(PathList *pathList) {
+    freePathList(pathList); // Free current paths
+    initPathList(pathList, pathList->capacity); // Reinitialize
+}
+
+
+
+// Add a path to the list, expanding the array if necessary dynamicaly
+void addPath(PathList *pathList, const char *path) {
+    if (pathList->count == pathList->capacity) {
+        // Need more space
+        int newCapacity = pathList->capacity * 2;
+        char **newPaths = (char**)realloc(pathList->paths, newCapacity * sizeof(char*));
+        if (!newPaths) {
+            perror("Unable to expand path list");
+            return;
+        }
+        pathList->paths = newPaths;
+        pathList->capacity = newCapacity;
+    }
+    // Allocate space for the new path and copy it
+    pathList->paths[pathList->count] = strdup(path);
+    pathList->count++;
+}
+
+
+
+// Initializes the default path. Its called always when the program starts.
+// For more default stuff, put it here using addPath like is used below.
+void initDefaultPath(PathList *pathList) {
+    addPath(pathList, "/bin"); // Add "/bin" as the default search path
+}
+
+
+
+// Returns true if any PATH entry is relative, so its meaning depends on the cwd
+bool pathListHasRelative(PathList *pathList) {
+    for (int i = 0; i < pathList->count; i++) {
+        if (pathList->paths[i][0] != '/') return true;
+    }
+    return false;
+}
+
+
+
+// print the current paths at PATH
+void printCurrentPaths() {
+    printf("Current paths:\n");
+    if (globalPathList.count == 0) {
+        printf("  (empty)\n");
+    }
+    for (int i = 0; i < globalPathList.count; i++) {
+        printf("  %s\n", globalPathList.paths[i]);
+    }
+}
+
+
+////////#########////////  END PATH HANDLING SHIT ////////#########//////// 
+
+
+
+////////#########////////  EXECUTABLE CACHE  ////////#########////////
+
+
+// One remembered command -> full path resolution (bash-style `hash` table)
+typedef struct ExecCacheEntry {
+    char *command;                // key: command name as typed (never contains '/')
+    char *path;                   // full path found by the PATH search
+    int dirIndex;                 // index of the globalPathList entry it was found in
+    unsigned int hits;            // times this entry answered a lookup
+    struct ExecCacheEntry *next;  // next entry in the same bucket
+} ExecCacheEntry;
+
+
+// struct definition for the global executable cache
+typedef struct {
+    ExecCacheEntry **buckets; // Array of bucket chains
+    int bucketCount;          // Number of buckets (always a power of two)
+    int count;                // Number of cached commands
+    struct timespec *dirStamps; // mtime of each PATH dir when the cache was populated
+    int dirStampCount;        // Number of valid entries in dirStamps
+} ExecCache;
+
+
+// global executable cache, populated lazily by findExecutable
+ExecCache globalExecCache;
+
+
+
+// djb2 string hash, good enough for short command names
+unsigned int hashCommandName(const char *command) {
+    unsigned int hash = 5381;
+    while (*command) {
+        hash = hash * 33 + (unsigned char)*command++;
+    }
+    return hash;
+}
+
+
+
+// Initialize an empty cache with the given number of buckets (power of two)
+void initExecCache(ExecCache *cache, int bucketCount) {
+    cache->buckets = calloc(bucketCount, sizeof(ExecCacheEntry*));
+    if (cache->buckets == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed in initExecCache\n");
+        exit(EXIT_FAILURE);
+    }
+    cache->bucketCount = bucketCount;
+    cache->count = 0;
+    cache->dirStamps = NULL;
+    cache->dirStampCount = 0;
+}
+
+
+
+// Drop every remembered command. Called whenever the search path changes
+void execCacheClear() {
+    ExecCache *cache = &globalExecCache;
+    for (int i = 0; i < cache->bucketCount; i++) {
+        ExecCacheEntry *entry = cache->buckets[i];
+        while (entry != NULL) {
+            ExecCacheEntry *next = entry->next;
+            free(entry->command);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        cache->buckets[i] = NULL;
+    }
+    cache->count = 0;
+    free(cache->dirStamps);
+    cache->dirStamps = NULL;
+    cache->dirStampCount = 0;
+    if (debug_mode) printf("Debug: Executable cache cleared\n");
+}
+
+
+
+// Double the number of buckets once the table gets too full
+void execCacheGrow(ExecCache *cache) {
+    int newCount = cache->bucketCount * 2;
+    ExecCacheEntry **newBuckets = calloc(newCount, sizeof(ExecCacheEntry*));
+    if (newBuckets == NULL) {
+        return; // Keep the old table, it still works, only slower
+    }
+    for (int i = 0; i < cache->bucketCount; i++) {
+        ExecCacheEntry *entry = cache->buckets[i];
+        while (entry != NULL) {
+            ExecCacheEntry *next = entry->next;
+            unsigned int slot = hashCommandName(entry->command) & (newCount - 1);
+            entry->next = newBuckets[slot];
+            newBuckets[slot] = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = newBuckets;
+    cache->bucketCount = newCount;
+}
+
+
+
+// Take a snapshot of the mtime of every PATH directory. Used by --hash-revalidate
+void execCacheStampDirs(ExecCache *cache) {
+    free(cache->dirStamps);
+    cache->dirStampCount = 0;
+    cache->dirStamps = malloc(globalPathList.count * sizeof(struct timespec));
+    if (cache->dirStamps == NULL) return;
+
+    for (int i = 0; i < globalPathList.count; i++) {
+        struct stat st;
+        if (stat(globalPathList.paths[i], &st) == 0) {
+            cache->dirStamps[i] = st.st_mtim;
+        } else {
+            cache->dirStamps[i].tv_sec = -1; // Missing directory, remember that too
+            cache->dirStamps[i].tv_nsec = 0;
+        }
+    }
+    cache->dirStampCount = globalPathList.count;
+}
+
+
+
+// Checks that no PATH directory searched before (and including) dirIndex changed
+// since the cache was populated. A directory gains a new mtime when entries are
+// added, removed or renamed inside it, which is exactly what can change a lookup
+bool execCacheDirsUnchanged(ExecCache *cache, int dirIndex) {
+    if (cache->dirStamps == NULL || dirIndex >= cache->dirStampCount) return false;
+
+    for (int i = 0; i <= dirIndex; i++) {
+        struct stat st;
+        struct timespec now = { -1, 0 };
+        if (stat(globalPathList.paths[i], &st) == 0) now = st.st_mtim;
+        if (now.tv_sec != cache->dirStamps[i].tv_sec || now.tv_nsec != cache->dirStamps[i].tv_nsec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+// Look a command up in the cache. Returns the cached path (owned by the cache) or NULL
+const char* execCacheLookup(const char *command) {
+    ExecCache *cache = &globalExecCache;
+    unsigned int slot = hashCommandName(command) & (cache->bucketCount - 1);
+
+    for (ExecCacheEntry *entry = cache->buckets[slot]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->command, command) != 0) continue;
+
+        if (hash_revalidate && !execCacheDirsUnchanged(cache, entry->dirIndex)) {
+            if (debug_mode) printf("Debug: PATH directory changed, dropping executable cache\n");
+            execCacheClear();
+            return NULL;
+        }
+        entry->hits++;
+        return entry->path;
+    }
+    return NULL;
+}
+
+
+
+// Remember where a command was found
+void execCacheInsert(const char *command, const char *path, int dirIndex) {
+    ExecCache *cache = &globalExecCache;
+    if (hash_revalidate && cache->dirStamps == NULL) {
+        execCacheStampDirs(cache);
+    }
+    if (cache->count >= cache->bucketCount) {
+        execCacheGrow(cache);
+    }
+
+    ExecCacheEntry *entry = malloc(sizeof(ExecCacheEntry));
+    if (entry == NULL) return; // Not fatal, the lookup just won't be cached
+    entry->command = strdup(command);
+    entry->path = strdup(path);
+    if (entry->command == NULL || entry->path == NULL) {
+        free(entry->command);
+        free(entry->path);
+        free(entry);
+        return;
+    }
+    entry->dirIndex = dirIndex;
+    entry->hits = 0;
+
+    unsigned int slot = hashCommandName(command) & (cache->bucketCount - 1);
+    entry->next = cache->buckets[slot];
+    cache->buckets[slot] = entry;
+    cache->count++;
+}
+
+
+
+// print the remembered commands, used by the `hash` builtin
+void printExecCache() {
+    ExecCache *cache = &globalExecCache;
+    if (cache->count == 0) {
+        printf("hash table empty\n");
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (int i = 0; i < cache->bucketCount; i++) {
+        for (ExecCacheEntry *entry = cache->buckets[i]; entry != NULL; entry = entry->next) {
+            printf("%4u\t%s\n", entry->hits, entry->path);
+        }
+    }
+}
+
+
+////////#########////////  END EXECUTABLE CACHE  ////////#########////////
+
+
+
+////////#########////////  CHILD LIMITS  ////////#########////////
+
+
+// Limits the shell puts on the commands it starts, set with the `ulimit` and `limit` builtins.
+// They are applied in the child between fork and exec, the shell itself never runs limited
+
+// Resources `ulimit` knows about, with bash's option letters and units
+typedef struct {
+    char option;
+    int resource;
+    rlim_t unit;          // Bytes (or seconds...) per unit of the value given on the command line
+    const char *name;
+} UlimitResource;
+
+const UlimitResource ulimitResources[] = {
+    { 'c', RLIMIT_CORE,   1024, "core file size (kbytes)" },
+    { 'd', RLIMIT_DATA,   1024, "data seg size (kbytes)" },
+    { 'f', RLIMIT_FSIZE,  1024, "file size (kbytes)" },
+    { 'n', RLIMIT_NOFILE, 1,    "open files" },
+    { 's', RLIMIT_STACK,  1024, "stack size (kbytes)" },
+    { 't', RLIMIT_CPU,    1,    "cpu time (seconds)" },
+    { 'u', RLIMIT_NPROC,  1,    "max user processes" },
+    { 'v', RLIMIT_AS,     1024, "virtual memory (kbytes)" },
+};
+
+#define ULIMIT_COUNT (sizeof(ulimitResources) / sizeof(ulimitResources[0]))
+
+typedef struct {
+    bool active;                    // Anything below is set, commands need a fork child
+    bool ulimitSet[ULIMIT_COUNT];
+    rlim_t ulimitValue[ULIMIT_COUNT];
+    bool niceSet;
+    int nice;                       // Absolute nice level of the commands
+    bool pinned;                    // Commands run on `cpus` only
+    bool spread;                    // Each '&' command of a line gets one CPU of `cpus`
+    cpu_set_t cpus;
+    int cgroupProcs;                // cgroup.procs of the cgroup to run in, or -1
+    char cgroupPath[PATH_MAX];
+} ChildLimits;
+
+ChildLimits child_limits = { .cgroupProcs = -1 };
+int spawn_cpu_slot = -1; // Index of the '&' command being started, for `limit spread`
+
+
+
+void child_limits_update() {
+    bool any = child_limits.niceSet || child_limits.pinned || child_limits.spread ||
+               child_limits.cgroupProcs != -1;
+    for (size_t i = 0; i < ULIMIT_COUNT; i++) any = any || child_limits.ulimitSet[i];
+    child_limits.active = any;
+}
+
+
+
+// Applies the limits to the calling process. Runs in fork and vfork children, so raw syscalls
+// only. Returns -1 if one of them could not be applied
+int child_limits_apply() {
+    ChildLimits *limits = &child_limits;
+    if (!limits->active) return 0;
+
+    // The cgroup first, so everything the command does is accounted there
+    if (limits->cgroupProcs != -1 && write(limits->cgroupProcs, "0", 1) != 1) return -1;
+
+    if (limits->spread && spawn_cpu_slot >= 0) {
+        int count = CPU_COUNT(&limits->cpus);
+        int wanted = count > 0 ? spawn_cpu_slot % count : 0;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &limits->cpus) && wanted-- == 0) {
+                CPU_SET(cpu, &one);
+                break;
+            }
+        }
+        if (sched_setaffinity(0, sizeof(one), &one) == -1) return -1;
+    } else if (limits->pinned) {
+        if (sched_setaffinity(0, sizeof(limits->cpus), &limits->cpus) == -1) return -1;
+    }
+
+    if (limits->niceSet && setpriority(PRIO_PROCESS, 0, limits->nice) == -1) return -1;
+
+    for (size_t i = 0; i < ULIMIT_COUNT; i++) {
+        if (!limits->ulimitSet[i]) continue;
+        struct rlimit limit = { limits->ulimitValue[i], limits->ulimitValue[i] };
+        if (setrlimit(ulimitResources[i].resource, &limit) == -1) return -1;
+    }
+    return 0;
+}
+
+
+
+// Limit a command started now would get for resource i
+rlim_t ulimit_current(size_t i) {
+    if (child_limits.ulimitSet[i]) return child_limits.ulimitValue[i];
+    struct rlimit limit;
+    getrlimit(ulimitResources[i].resource, &limit);
+    return limit.rlim_cur;
+}
+
+
+
+void ulimit_print(size_t i, bool withName) {
+    rlim_t value = ulimit_current(i);
+    if (withName) printf("%-28s(-%c) ", ulimitResources[i].name, ulimitResources[i].option);
+    if (value == RLIM_INFINITY) {
+        printf("unlimited\n");
+    } else {
+        printf("%llu\n", (unsigned long long)(value / ulimitResources[i].unit));
+    }
+}
+
+
+
+// ulimit [-a | -c|-d|-f|-n|-s|-t|-u|-v [N|unlimited]]: shows or sets a limit of the commands
+// started from now on. The shell's own limits stay as they are
+int builtin_ulimit(char **args, int arg_count) {
+    if (arg_count > 3) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    const char *option = arg_count > 1 ? args[1] : "-f"; // Like bash, the file size by default
+    if (strcmp(option, "-a") == 0 && arg_count == 2) {
+        for (size_t i = 0; i < ULIMIT_COUNT; i++) ulimit_print(i, true);
+        return 0;
+    }
+
+    size_t i = 0;
+    while (i < ULIMIT_COUNT && !(option[0] == '-' && option[1] == ulimitResources[i].option && option[2] == '\0')) i++;
+    if (i == ULIMIT_COUNT) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    if (arg_count < 3) {
+        ulimit_print(i, false);
+        return 0;
+    }
+
+    rlim_t value = RLIM_INFINITY;
+    if (strcmp(args[2], "unlimited") != 0) {
+        char *end;
+        errno = 0;
+        unsigned long long number = strtoull(args[2], &end, 10);
+        if (args[2][0] == '-' || *end != '\0' || end == args[2] || errno != 0 ||
+            number > RLIM_INFINITY / ulimitResources[i].unit) {
+            fprintf(stderr, "An error has occurred\n");
+            return 1;
+        }
+        value = number * ulimitResources[i].unit;
+    }
+    // Above the hard limit the child's setrlimit() would fail, tell now instead
+    struct rlimit hard;
+    getrlimit(ulimitResources[i].resource, &hard);
+    if (hard.rlim_max != RLIM_INFINITY && (value == RLIM_INFINITY || value > hard.rlim_max)) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    child_limits.ulimitSet[i] = true;
+    child_limits.ulimitValue[i] = value;
+    child_limits_update();
+    return 0;
+}
+
+
+
+// Parses a CPU list like "0-3,6" into `set`. Returns false if it is malformed
+bool parse_cpu_list(const char *text, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*text != '\0') {
+        char *end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if (end == text || first < 0) return false;
+        if (*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text || last < first) return false;
+        }
+        if (last >= CPU_SETSIZE) return false;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        if (*end == ',') end++;
+        else if (*end != '\0') return false;
+        text = end;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+
+
+void print_cpu_list(const cpu_set_t *set) {
+    const char *separator = "";
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, set)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+        if (last == cpu) printf("%s%d", separator, cpu);
+        else printf("%s%d-%d", separator, cpu, last);
+        separator = ",";
+        cpu = last;
+    }
+}
+
+
+
+// Writes `value` to the control file `name` of the cgroup at `dir`. When the controller isn't
+// enabled for the cgroup yet, enables it in the parent's cgroup.subtree_control and retries
+bool cgroup_write(const char *dir, const char *name, const char *value) {
+    char file[PATH_MAX + 64];
+    snprintf(file, sizeof(file), "%s/%s", dir, name);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int fd = open(file, O_WRONLY | O_CLOEXEC);
+        if (fd != -1) {
+            bool ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+            close(fd);
+            return ok;
+        }
+        if (errno != ENOENT || attempt > 0) break;
+
+        char parent[PATH_MAX + 64];
+        snprintf(parent, sizeof(parent), "%s", dir);
+        char *slash = strrchr(parent, '/');
+        if (slash == NULL) break;
+        char controller[32];
+        snprintf(controller, sizeof(controller), "+%.*s", (int)strcspn(name, "."), name);
+        snprintf(slash, sizeof(parent) - (slash - parent), "/cgroup.subtree_control");
+        int control = open(parent, O_WRONLY | O_CLOEXEC);
+        if (control == -1) break;
+        bool enabled = write(control, controller, strlen(controller)) == (ssize_t)strlen(controller);
+        close(control);
+        if (!enabled) break;
+    }
+    return false;
+}
+
+
+
+// limit cgroup DIR [cpu=PERCENT] [memory=SIZE] [pids=N]
+int limit_cgroup(char **args, int arg_count) {
+    if (arg_count < 3) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    if (child_limits.cgroupProcs != -1) close(child_limits.cgroupProcs);
+    child_limits.cgroupProcs = -1;
+    if (strcmp(args[2], "off") == 0 && arg_count == 3) {
+        child_limits_update();
+        return 0;
+    }
+
+    // Relative names live under the cgroup v2 mount
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s%s", args[2][0] == '/' ? "" : "/sys/fs/cgroup/", args[2]);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "An error has occurred\n");
+        child_limits_update();
+        return 1;
+    }
+    for (int i = 3; i < arg_count; i++) {
+        char value[64];
+        const char *file = NULL;
+        if (strncmp(args[i], "cpu=", 4) == 0) {
+            // PERCENT of one CPU per 100ms period, "max" for no cap
+            char *end;
+            long percent = strtol(args[i] + 4, &end, 10);
+            if (strcmp(args[i] + 4, "max") == 0) {
+                snprintf(value, sizeof(value), "max 100000");
+                file = "cpu.max";
+            } else if (end != args[i] + 4 && *end == '\0' && percent > 0) {
+                snprintf(value, sizeof(value), "%ld 100000", percent * 1000);
+                file = "cpu.max";
+            }
+        } else if (strncmp(args[i], "memory=", 7) == 0) {
+            snprintf(value, sizeof(value), "%s", args[i] + 7); // The kernel takes "512M", "max"...
+            file = "memory.max";
+        } else if (strncmp(args[i], "pids=", 5) == 0) {
+            snprintf(value, sizeof(value), "%s", args[i] + 5);
+            file = "pids.max";
+        }
+        if (file == NULL || !cgroup_write(dir, file, value)) {
+            fprintf(stderr, "An error has occurred\n");
+            child_limits_update();
+            return 1;
+        }
+    }
+
+    char procs[PATH_MAX + 16];
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", dir);
+    child_limits.cgroupProcs = open(procs, O_WRONLY | O_CLOEXEC);
+    child_limits_update();
+    if (child_limits.cgroupProcs == -1) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    snprintf(child_limits.cgroupPath, sizeof(child_limits.cgroupPath), "%s", dir);
+    return 0;
+}
+
+
+
+// limit                      shows what commands run with
+// limit nice N|off           nice level of the commands
+// limit cpus LIST|off        CPU affinity of the commands, e.g. 0-3,6
+// limit spread on|off        each '&' command of a line on its own CPU of the set
+// limit cgroup DIR [cpu=PERCENT] [memory=SIZE] [pids=N] | off
+// limit reset                drops every limit, ulimit ones included
+int builtin_limit(char **args, int arg_count) {
+    ChildLimits *limits = &child_limits;
+    int status = 0;
+
+    if (arg_count == 1) {
+        if (limits->niceSet) printf("nice %d\n", limits->nice);
+        if (limits->pinned) {
+            printf("cpus ");
+            print_cpu_list(&limits->cpus);
+            printf("\n");
+        }
+        if (limits->spread) printf("spread on\n");
+        if (limits->cgroupProcs != -1) printf("cgroup %s\n", limits->cgroupPath);
+        for (size_t i = 0; i < ULIMIT_COUNT; i++) {
+            if (limits->ulimitSet[i]) {
+                printf("ulimit -%c ", ulimitResources[i].option);
+                ulimit_print(i, false);
+            }
+        }
+        return 0;
+    }
+
+    const char *what = args[1];
+    if (strcmp(what, "cgroup") == 0) return limit_cgroup(args, arg_count);
+    if (strcmp(what, "reset") == 0 && arg_count == 2) {
+        if (limits->cgroupProcs != -1) close(limits->cgroupProcs);
+        memset(limits, 0, sizeof(*limits));
+        limits->cgroupProcs = -1;
+        return 0;
+    }
+    if (arg_count != 3) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+
+    const char *value = args[2];
+    bool off = strcmp(value, "off") == 0;
+    if (strcmp(what, "nice") == 0) {
+        char *end;
+        long level = strtol(value, &end, 10);
+        if (off) {
+            limits->niceSet = false;
+        } else if (end != value && *end == '\0' && level >= -20 && level <= 19) {
+            limits->niceSet = true;
+            limits->nice = (int)level;
+        } else {
+            status = 1;
+        }
+    } else if (strcmp(what, "cpus") == 0) {
+        cpu_set_t cpus;
+        if (off) {
+            limits->pinned = false;
+            if (limits->spread) sched_getaffinity(0, sizeof(limits->cpus), &limits->cpus);
+        } else if (parse_cpu_list(value, &cpus)) {
+            limits->pinned = true;
+            limits->cpus = cpus;
+        } else {
+            status = 1;
+        }
+    } else if (strcmp(what, "spread") == 0) {
+        if (off || strcmp(value, "on") == 0) {
+            limits->spread = !off;
+            // Without `limit cpus` the '&' commands spread over the CPUs we may use
+            if (limits->spread && !limits->pinned) sched_getaffinity(0, sizeof(limits->cpus), &limits->cpus);
+        } else {
+            status = 1;
+        }
+    } else {
+        status = 1;
+    }
+
+    if (status != 0) fprintf(stderr, "An error has occurred\n");
+    child_limits_update();
+    return status;
+}
+
+
+////////#########////////  END CHILD LIMITS  ////////#########////////
+
+
+
+////////#########////////  COMMAND STATS  ////////#########////////
+
+
+// Every external command the shell starts is remembered until it is reaped with wait4(), which
+// hands back its CPU times and peak memory. `stats` shows them per program, `times` the totals
+
+
+// Totals of one program (by args[0] as written)
+typedef struct {
+    char *name;
+    uint64_t runs;
+    uint64_t wallNs;   // Spawn to reap
+    uint64_t userUs;
+    uint64_t sysUs;
+    long maxRss;       // KiB, peak of any single run
+} CommandStats;
+
+// A started command that wasn't reaped yet
+typedef struct {
+    pid_t pid;
+    int entry;         // Index in commandStats
+    uint64_t start;
+} TrackedChild;
+
+CommandStats *commandStats = NULL;
+int commandStatsCount = 0, commandStatsCapacity = 0;
+TrackedChild *trackedChildren = NULL;
+int trackedCount = 0, trackedCapacity = 0;
+
+
+
+// Starts the clock of a command the shell just spawned
+void stats_track(pid_t pid, const char *name) {
+    int entry = 0;
+    while (entry < commandStatsCount && strcmp(commandStats[entry].name, name) != 0) entry++;
+    if (entry == commandStatsCount) {
+        if (commandStatsCount == commandStatsCapacity) {
+            commandStatsCapacity = commandStatsCapacity ? commandStatsCapacity * 2 : 16;
+            commandStats = realloc(commandStats, commandStatsCapacity * sizeof(CommandStats));
+            if (commandStats == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memset(&commandStats[entry], 0, sizeof(CommandStats));
+        commandStats[entry].name = strdup(name);
+        commandStatsCount++;
+    }
+    if (trackedCount == trackedCapacity) {
+        trackedCapacity = trackedCapacity ? trackedCapacity * 2 : 16;
+        trackedChildren = realloc(trackedChildren, trackedCapacity * sizeof(TrackedChild));
+        if (trackedChildren == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    trackedChildren[trackedCount++] = (TrackedChild){ pid, entry, now_ns() };
+}
+
+
+
+// waitpid() that also books the resource usage of the reaped child to its command
+pid_t wait_child(pid_t pid, int *status, int options) {
+    struct rusage usage;
+    pid_t done = wait4(pid, status, options, &usage);
+    if (done <= 0) return done;
+
+    for (int i = 0; i < trackedCount; i++) {
+        if (trackedChildren[i].pid != done) continue;
+        CommandStats *stats = &commandStats[trackedChildren[i].entry];
+        stats->runs++;
+        stats->wallNs += now_ns() - trackedChildren[i].start;
+        stats->userUs += usage.ru_utime.tv_sec * 1000000ULL + usage.ru_utime.tv_usec;
+        stats->sysUs += usage.ru_stime.tv_sec * 1000000ULL + usage.ru_stime.tv_usec;
+        if (usage.ru_maxrss > stats->maxRss) stats->maxRss = usage.ru_maxrss;
+        trackedChildren[i] = trackedChildren[--trackedCount];
+        break;
+    }
+    return done;
+}
+
+
+
+int compare_stats_wall(const void *a, const void *b) {
+    uint64_t x = ((const CommandStats *)a)->wallNs, y = ((const CommandStats *)b)->wallNs;
+    return (x < y) - (x > y); // Biggest first
+}
+
+
+
+// stats [-r]: per program runs, wall/user/sys seconds and peak RSS, the heaviest first.
+// -r forgets them
+int builtin_stats(char **args, int arg_count) {
+    if (arg_count == 2 && strcmp(args[1], "-r") == 0) {
+        for (int i = 0; i < commandStatsCount; i++) {
+            commandStats[i].runs = commandStats[i].wallNs = commandStats[i].userUs = commandStats[i].sysUs = 0;
+            commandStats[i].maxRss = 0;
+        }
+        return 0;
+    }
+    if (arg_count > 1) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+
+    // Sort a copy, tracked children point into the table by index
+    CommandStats *sorted = malloc((commandStatsCount + 1) * sizeof(CommandStats));
+    if (sorted == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(sorted, commandStats, commandStatsCount * sizeof(CommandStats));
+    qsort(sorted, commandStatsCount, sizeof(CommandStats), compare_stats_wall);
+
+    CommandStats total = { "total", 0, 0, 0, 0, 0 };
+    printf("%-16s %6s %10s %10s %10s %10s\n", "command", "runs", "wall", "user", "sys", "maxrss_kb");
+    for (int i = 0; i <= commandStatsCount; i++) {
+        CommandStats *stats = i < commandStatsCount ? &sorted[i] : &total;
+        if (stats->runs == 0 && stats != &total) continue;
+        printf("%-16s %6llu %10.3f %10.3f %10.3f %10ld\n", stats->name, (unsigned long long)stats->runs,
+               stats->wallNs / 1e9, stats->userUs / 1e6, stats->sysUs / 1e6, stats->maxRss);
+        if (stats == &total) break;
+        total.runs += stats->runs;
+        total.wallNs += stats->wallNs;
+        total.userUs += stats->userUs;
+        total.sysUs += stats->sysUs;
+        if (stats->maxRss > total.maxRss) total.maxRss = stats->maxRss;
+    }
+    free(sorted);
+    return 0;
+}
+
+
+
+void print_times(struct timeval user, struct timeval sys) {
+    printf("%ldm%ld.%03lds %ldm%ld.%03lds\n",
+           (long)user.tv_sec / 60, (long)user.tv_sec % 60, (long)user.tv_usec / 1000,
+           (long)sys.tv_sec / 60, (long)sys.tv_sec % 60, (long)sys.tv_usec / 1000);
+}
+
+
+
+// times: user and system time of the shell, then of all its reaped children (POSIX format)
+int builtin_times(char **args, int arg_count) {
+    (void)args;
+    if (arg_count > 1) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    print_times(self.ru_utime, self.ru_stime);
+    print_times(children.ru_utime, children.ru_stime);
+    return 0;
+}
+
+
+////////#########////////  END COMMAND STATS  ////////#########////////
+
+
+
+////////#########////////  SHELL EXECUTION LOGIC ////////#########//////// 
+
+
+#define UTILITY_BUFFER 8192 // Output buffered by the native utilities before a write()
+
+
+// Output of a native utility: collected here and written to fd 1 with plain write() calls, so
+// it never mixes with (or waits in) the shell's own stdio buffer
+typedef struct {
+    char data[UTILITY_BUFFER];
+    size_t len;
+    bool failed;   // A write() failed (closed pipe, full disk...)
+} UtilityOutput;
+
+
+
+// write() all of `len` bytes to `fd`. Returns -1 on error
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+
+void utility_flush(UtilityOutput *out) {
+    if (out->len > 0 && write_all(STDOUT_FILENO, out->data, out->len) == -1) out->failed = true;
+    out->len = 0;
+}
+
+
+
+void utility_put(UtilityOutput *out, const char *data, size_t len) {
+    if (out->len + len > sizeof(out->data)) {
+        utility_flush(out);
+        if (len > sizeof(out->data)) { // Too big to buffer, goes out directly
+            if (write_all(STDOUT_FILENO, data, len) == -1) out->failed = true;
+            return;
+        }
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+
+
+int builtin_exit(char **args, int arg_count) {
+    (void)args;
+    if (arg_count > 1) { // If there are more arguments after 'exit'
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    if (bench_mode) {
+        bench_stop_iteration = 1; // Only ends the current benchmark run
+        return 0;
+    }
+    jobs_wait_all(); // Background jobs finish first, like at the end of the input
+    exit(0); // Correct use of exit
+}
+
+
+
+int builtin_cd(char **args, int arg_count) {
+    if (arg_count != 2) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    if (chdir(args[1]) != 0) {
+        perror("An error has occurred\n");
+        return 1;
+    }
+    if (pathListHasRelative(&globalPathList)) {
+        execCacheClear(); // Relative PATH entries now point somewhere else
+    }
+    return 0;
+}
+
+
+
+int builtin_path(char **args, int arg_count) {
+    clearPaths(&globalPathList); // Clear existing paths
+    for (int i = 1; i < arg_count; i++) {
+        addPath(&globalPathList, args[i]); // Add new paths
+    }
+    execCacheClear(); // Every remembered lookup is stale now
+
+    if (debug_mode) {
+        printCurrentPaths(); // Print paths only if in debug mode
+    }
+    return 0;
+}
+
+
+
+int builtin_hash(char **args, int arg_count) {
+    int status = 0;
+    if (arg_count == 1) {
+        printExecCache(); // Show the remembered commands
+    } else if (strcmp(args[1], "-r") == 0 && arg_count == 2) {
+        execCacheClear(); // Forget everything
+    } else {
+        // Look the given commands up now so later runs hit the cache
+        for (int i = 1; i < arg_count; i++) {
+            char *found = (strchr(args[i], '/') == NULL) ? findExecutable(args[i]) : NULL;
+            if (found == NULL) {
+                fprintf(stderr, "An error has occurred\n");
+                status = 1;
+            }
+            free(found);
+        }
+    }
+    return status;
+}
+
+
+
+int builtin_jobs(char **args, int arg_count) {
+    (void)args;
+    if (arg_count > 1) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    jobs_print();
+    return 0;
+}
+
+
+
+int builtin_wait(char **args, int arg_count) {
+    int status = 0;
+    if (arg_count == 1) {
+        jobs_wait_all();
+    }
+    for (int i = 1; i < arg_count; i++) {
+        // Job ids as printed by `jobs`, with or without the leading '%'
+        const char *id = args[i][0] == '%' ? args[i] + 1 : args[i];
+        char *end;
+        long number = strtol(id, &end, 10);
+        if (*id == '\0' || *end != '\0' || !jobs_wait_one((int)number)) {
+            fprintf(stderr, "An error has occurred\n");
+            status = 1;
+        }
+    }
+    return status;
+}
+
+
+
+int builtin_true(char **args, int arg_count) {
+    (void)args;
+    (void)arg_count;
+    return 0;
+}
+
+
+
+int builtin_false(char **args, int arg_count) {
+    (void)args;
+    (void)arg_count;
+    return 1;
+}
+
+
+
+// echo as GNU coreutils does it: leading -n/-e/-E options (only words made of those letters),
+// and with -e the backslash escapes, where \c ends the output
+int builtin_echo(char **args, int arg_count) {
+    UtilityOutput out;
+    out.len = 0;
+    out.failed = false;
+    bool newline = true, escapes = false;
+
+    int i = 1;
+    for (; i < arg_count && args[i][0] == '-' && args[i][1] != '\0' &&
+           strspn(args[i] + 1, "neE") == strlen(args[i] + 1); i++) {
+        for (const char *option = args[i] + 1; *option; option++) {
+            if (*option == 'n') newline = false;
+            else escapes = (*option == 'e');
+        }
+    }
+
+    for (; i < arg_count; i++) {
+        const char *s = args[i];
+        if (!escapes) {
+            utility_put(&out, s, strlen(s));
+        } else {
+            while (*s) {
+                char c = *s++;
+                if (c != '\\' || *s == '\0') {
+                    utility_put(&out, &c, 1);
+                    continue;
+                }
+                c = *s++;
+                switch (c) {
+                    case 'a': c = '\a'; break;
+                    case 'b': c = '\b'; break;
+                    case 'e': c = 0x1b; break;
+                    case 'f': c = '\f'; break;
+                    case 'n': c = '\n'; break;
+                    case 'r': c = '\r'; break;
+                    case 't': c = '\t'; break;
+                    case 'v': c = '\v'; break;
+                    case '\\': break;
+                    case 'c':
+                        utility_flush(&out); // Nothing else is printed, not even the newline
+                        return out.failed ? 1 : 0;
+                    case 'x':
+                        if (!isxdigit((unsigned char)*s)) {
+                            utility_put(&out, "\\", 1); // Not an escape after all
+                            break;
+                        }
+                        c = 0;
+                        for (int d = 0; d < 2 && isxdigit((unsigned char)*s); d++, s++) {
+                            c = c * 16 + (isdigit((unsigned char)*s) ? *s - '0' : (tolower((unsigned char)*s) - 'a' + 10));
+                        }
+                        break;
+                    case '0':
+                        if (*s < '0' || *s > '7') {
+                            c = 0;
+                            break;
+                        }
+                        c = *s++;
+                        // fall through
+                    case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+                        c -= '0';
+                        for (int d = 0; d < 2 && *s >= '0' && *s <= '7'; d++) c = c * 8 + (*s++ - '0');
+                        break;
+                    default:
+                        utility_put(&out, "\\", 1); // Unknown escape, kept as written
+                        break;
+                }
+                utility_put(&out, &c, 1);
+            }
+        }
+        if (i < arg_count - 1) utility_put(&out, " ", 1);
+    }
+    if (newline) utility_put(&out, "\n", 1);
+    utility_flush(&out);
+    return out.failed ? 1 : 0;
+}
+
+
+
+// The real echo prints its help or version for a lone --help/--version
+bool echo_accepts(char **args, int arg_count) {
+    return !(arg_count == 2 && (strcmp(args[1], "--help") == 0 || strcmp(args[1], "--version") == 0));
+}
+
+
+
+// cat of files (or "-" for stdin) to stdout. sendfile() for regular files, copy otherwise
+int builtin_cat(char **args, int arg_count) {
+    int status = 0;
+    for (int i = arg_count == 1 ? 0 : 1; i < arg_count; i++) {
+        bool useStdin = (i == 0 || strcmp(args[i], "-") == 0);
+        const char *name = useStdin ? "-" : args[i];
+        int fd = useStdin ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        int result = 0;
+        ssize_t sent;
+        while ((sent = sendfile(STDOUT_FILENO, fd, NULL, 1 << 30)) > 0) {}
+        if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            result = copy_stream(fd, STDOUT_FILENO, -1); // Not a file sendfile() reads from
+        } else if (sent == -1) {
+            result = -1;
+        }
+        if (result == -1) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+        }
+        if (!useStdin) close(fd);
+    }
+    return status;
+}
+
+
+
+// Only plain `cat [FILE|-]...`, options like -n are left to the real program
+bool cat_accepts(char **args, int arg_count) {
+    for (int i = 1; i < arg_count; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') return false;
+    }
+    return true;
+}
+
+
+
+// Unary test of `test`/`[`. Returns 0 (true), 1 (false) or -1 if `op` isn't a unary operator
+int test_unary(const char *op, const char *arg) {
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') return -1;
+
+    struct stat st;
+    switch (op[1]) {
+        case 'n': return arg[0] != '\0' ? 0 : 1;
+        case 'z': return arg[0] == '\0' ? 0 : 1;
+        case 'r': return access(arg, R_OK) == 0 ? 0 : 1;
+        case 'w': return access(arg, W_OK) == 0 ? 0 : 1;
+        case 'x': return access(arg, X_OK) == 0 ? 0 : 1;
+        case 't': return isatty(atoi(arg)) ? 0 : 1;
+        case 'h':
+        case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode) ? 0 : 1;
+    }
+    bool exists = stat(arg, &st) == 0;
+    switch (op[1]) {
+        case 'e': return exists ? 0 : 1;
+        case 'f': return exists && S_ISREG(st.st_mode) ? 0 : 1;
+        case 'd': return exists && S_ISDIR(st.st_mode) ? 0 : 1;
+        case 'b': return exists && S_ISBLK(st.st_mode) ? 0 : 1;
+        case 'c': return exists && S_ISCHR(st.st_mode) ? 0 : 1;
+        case 'p': return exists && S_ISFIFO(st.st_mode) ? 0 : 1;
+        case 'S': return exists && S_ISSOCK(st.st_mode) ? 0 : 1;
+        case 's': return exists && st.st_size > 0 ? 0 : 1;
+        case 'u': return exists && (st.st_mode & S_ISUID) ? 0 : 1;
+        case 'g': return exists && (st.st_mode & S_ISGID) ? 0 : 1;
+        case 'k': return exists && (st.st_mode & S_ISVTX) ? 0 : 1;
+        case 'O': return exists && st.st_uid == geteuid() ? 0 : 1;
+        case 'G': return exists && st.st_gid == getegid() ? 0 : 1;
+        case 'N': return exists && (st.st_mtim.tv_sec > st.st_atim.tv_sec ||
+                         (st.st_mtim.tv_sec == st.st_atim.tv_sec && st.st_mtim.tv_nsec > st.st_atim.tv_nsec)) ? 0 : 1;
+    }
+    return -1;
+}
+
+
+
+// Parses an integer operand of `test`. Prints the error and returns false if it isn't one
+bool test_integer(const char *text, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (text[0] == '\0' || *end != '\0' || errno == ERANGE) {
+        fprintf(stderr, "test: invalid integer '%s'\n", text);
+        return false;
+    }
+    return true;
+}
+
+
+
+// Binary test of `test`/`[`. Returns 0 (true), 1 (false), 2 (bad operand) or -1 if `op`
+// isn't a binary operator
+int test_binary(const char *left, const char *op, const char *right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) == 0 ? 0 : 1;
+    if (strcmp(op, "!=") == 0) return strcmp(left, right) != 0 ? 0 : 1;
+    if (strcmp(op, "-a") == 0) return left[0] != '\0' && right[0] != '\0' ? 0 : 1;
+    if (strcmp(op, "-o") == 0) return left[0] != '\0' || right[0] != '\0' ? 0 : 1;
+
+    static const char *numeric[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+    for (int i = 0; i < 6; i++) {
+        if (strcmp(op, numeric[i]) != 0) continue;
+        long long a, b;
+        if (!test_integer(left, &a) || !test_integer(right, &b)) return 2;
+        bool result[] = { a == b, a != b, a < b, a <= b, a > b, a >= b };
+        return result[i] ? 0 : 1;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat a, b;
+        bool haveA = stat(left, &a) == 0, haveB = stat(right, &b) == 0;
+        if (strcmp(op, "-ef") == 0) {
+            return haveA && haveB && a.st_dev == b.st_dev && a.st_ino == b.st_ino ? 0 : 1;
+        }
+        bool newer = haveA && (!haveB || a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+                     (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec));
+        bool older = haveB && (!haveA || b.st_mtim.tv_sec > a.st_mtim.tv_sec ||
+                     (a.st_mtim.tv_sec == b.st_mtim.tv_sec && b.st_mtim.tv_nsec > a.st_mtim.tv_nsec));
+        return (op[1] == 'n' ? newer : older) ? 0 : 1;
+    }
+    return -1;
+}
+
+
+
+// Evaluates `count` operands of test with the POSIX rules for up to four arguments.
+// Returns 0 (true), 1 (false) or 2 (syntax error, already reported)
+int test_evaluate(char **argv, int count) {
+    int result = -1;
+    switch (count) {
+        case 0:
+            return 1;
+        case 1:
+            return argv[0][0] != '\0' ? 0 : 1;
+        case 2:
+            if (strcmp(argv[0], "!") == 0) return test_evaluate(argv + 1, 1) == 0 ? 1 : 0;
+            result = test_unary(argv[0], argv[1]);
+            break;
+        case 3:
+            result = test_binary(argv[0], argv[1], argv[2]);
+            if (result == -1 && strcmp(argv[0], "!") == 0) {
+                result = test_evaluate(argv + 1, 2);
+                if (result < 2) result = !result;
+            } else if (result == -1 && strcmp(argv[0], "(") == 0 && strcmp(argv[2], ")") == 0) {
+                result = test_evaluate(argv + 1, 1);
+            }
+            break;
+        case 4:
+            if (strcmp(argv[0], "!") == 0) {
+                result = test_evaluate(argv + 1, 3);
+                if (result < 2) result = !result;
+            } else if (strcmp(argv[0], "(") == 0 && strcmp(argv[3], ")") == 0) {
+                result = test_evaluate(argv + 1, 2);
+            }
+            break;
+    }
+    if (result == -1) {
+        fprintf(stderr, "test: syntax error\n");
+        return 2;
+    }
+    return result;
+}
+
+
+
+// `test EXPR` and `[ EXPR ]`
+int builtin_test(char **args, int arg_count) {
+    int count = arg_count - 1;
+    if (strcmp(args[0], "[") == 0) {
+        if (count == 0 || strcmp(args[arg_count - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        count--;
+    }
+    return test_evaluate(args + 1, count);
+}
+
+
+
+// Up to three operands, or four behind '!' or inside '( )'. Longer expressions, like
+// `-n a -a -d b`, need the precedence rules of the real program
+bool test_accepts(char **args, int arg_count) {
+    int count = arg_count - 1;
+    if (strcmp(args[0], "[") == 0 && count > 0 && strcmp(args[arg_count - 1], "]") == 0) count--;
+    if (count <= 3) return true;
+    return count == 4 && (strcmp(args[1], "!") == 0 ||
+                          (strcmp(args[1], "(") == 0 && strcmp(args[4], ")") == 0));
+}
+
+
+
+// A command the shell runs itself
+typedef struct {
+    const char *name;
+    int (*run)(char **args, int arg_count);         // Returns the exit status
+    bool (*accepts)(char **args, int arg_count);    // NULL, or false for uses left to the program
+    bool utility;   // Native stand-in for a program: honours '>', off with --no-native-utils
+} Builtin;
+
+
+const Builtin builtins[] = {
+    { "exit",  builtin_exit,  NULL,         false },
+    { "cd",    builtin_cd,    NULL,         false },
+    { "path",  builtin_path,  NULL,         false },
+    { "hash",  builtin_hash,  NULL,         false },
+    { "jobs",  builtin_jobs,  NULL,         false },
+    { "wait",  builtin_wait,  NULL,         false },
+    { "ulimit", builtin_ulimit, NULL,       false },
+    { "limit", builtin_limit, NULL,         false },
+    { "stats", builtin_stats, NULL,         false },
+    { "times", builtin_times, NULL,         false },
+    { "parallel", builtin_parallel, NULL,   false },
+    { "map",   builtin_parallel, NULL,      false },
+    { "echo",  builtin_echo,  echo_accepts, true },
+    { "true",  builtin_true,  NULL,         true },
+    { "false", builtin_false, NULL,         true },
+    { "cat",   builtin_cat,   cat_accepts,  true },
+    { "test",  builtin_test,  test_accepts, true },
+    { "[",     builtin_test,  test_accepts, true },
+};
+
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+
+
+
+// Table entry named `name`, or NULL
+const Builtin* builtin_named(const char *name) {
+    for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+        if (builtins[i].name[0] == name[0] && strcmp(builtins[i].name, name) == 0) return &builtins[i];
+    }
+    return NULL;
+}
+
+
+
+// Returns the builtin that runs this command line, or NULL if it's an external program.
+// A native utility only stands in for a program the path would find, so `path` keeps
+// deciding what can run; the lookup is normally an executable cache hit
+const Builtin* find_builtin(char **args, int arg_count) {
+    if (arg_count == 0) return NULL;
+    const Builtin *builtin = builtin_named(args[0]);
+    if (builtin == NULL || !builtin->utility) return builtin;
+
+    if (!native_utilities || child_limits.active) return NULL; // Limited commands need a process
+    if (builtin->accepts != NULL && !builtin->accepts(args, arg_count)) return NULL;
+    char *program = findExecutable(args[0]);
+    if (program == NULL) return NULL; // Runs as external, and fails like the program would
+    free(program);
+    return builtin;
+}
+
+
+
+// Returns true if the command is a builtin that reads or changes the shell itself (cd, path...),
+// as opposed to a native utility
+bool is_shell_builtin(SimpleCommand *cmd) {
+    const Builtin *builtin = cmd->argCount > 0 ? builtin_named(cmd->args[0]) : NULL;
+    return builtin != NULL && !builtin->utility;
+}
+
+
+
+// Runs `builtin` (as found by find_builtin) with the given arguments, the exit status goes to
+// builtin_status
+void run_builtin(const Builtin *builtin, char **args, int arg_count) {
+    if (builtin->utility) fflush(stdout); // Utilities write(), keep the order with printf output
+    builtin_status = builtin->run(args, arg_count);
+}
+
+// Runs every command of an already parsed line
+void execute_command_line(CommandLine *parsed) {
+    if (bench_mode) {
+        for (int i = 0; i < parsed->commandCount; i++) {
+            for (Pipeline *command = &parsed->commands[i]; command != NULL; command = command->next) {
+                benchCommands += command->stageCount;
+            }
+        }
+    }
+    if (background_jobs) {
+        jobs_reap(0); // Collect background jobs that finished meanwhile, never blocks
+    }
+
+    if (parsed->commandCount == 0) {
+        // Empty line, only whitespace or only '&': nothing to do, and not an error
+    } else if (parsed->background && background_jobs) {
+        // Start the whole line as a job and go on with the next one
+        job_start(parsed);
+        last_status = 0;
+    } else if (parsed->commandCount > 1) {
+        // Handle all commands in parallel
+        execute_commands_in_parallel(parsed);
+    } else {
+        // Process a single command (or and-or list)
+        execute_and_or(&parsed->commands[0]);
+    }
+    glob_cache_reset(); // Directory scans are shared by the commands of one line only
+}
+
+
+
+// Parses commands and executes them. `line` is a view of `len` bytes, it needs no terminator
+void process_command(const char *line, size_t len) {
+    uint64_t lineStart = PROBE_START();
+
+    // One pass over the line builds the whole command tree in the line arena
+    uint64_t parseStart = PROBE_START();
+    CommandLine *parsed = parse_line(&lineArena, line, len);
+    PROBE_END(PHASE_PARSE, parseStart, len);
+    execute_command_line(parsed);
+    PROBE_END(PHASE_LINE, lineStart, len);
+
+    arena_reset(&lineArena); // Everything parse_line produced goes away at once
+}
+
+
+
+
+
+////////#########//////// END SHELL EXECUTION LOGIC ////////#########////////
+
+
+
+
+////////#########//////// GLOB EXPANSION ////////#########////////
+
+
+// Words with '*', '?' or '[...]' are expanded to the sorted list of matching paths right before
+// their pipeline runs, like sh does; a pattern matching nothing stays as it is. Names starting
+// with '.' only match a pattern component that starts with '.', and "." and ".." never do.
+// Redirection targets aren't expanded.
+//
+// Directories are read with getdents64() straight into a per-line cache: patterns of one line
+// that look into the same directory, and all the '&' commands of the line, share one scan. The
+// cache and every name in it live in globArena, and is dropped when the line is done or, in an
+// and-or list, once a pipeline finished (it may have created or removed files)
+
+#define GLOB_SCAN_BUFFER 32768 // getdents64() batch
+
+
+// Record layout of getdents64()
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} GlobDirent;
+
+// One name of a scanned directory
+typedef struct {
+    const char *name;
+    unsigned char type;  // d_type, DT_UNKNOWN if the filesystem didn't tell
+} GlobName;
+
+// A scanned directory of the line, `path` as the pattern spelled it ("" is the working one)
+typedef struct GlobDir {
+    const char *path;
+    GlobName *names;     // Sorted by name
+    int count;
+    struct GlobDir *next;
+} GlobDir;
+
+Arena globArena;
+GlobDir *globDirs = NULL;
+
+// Grow-only scratch arrays, reused by every scan and expansion
+GlobName *globScratchNames = NULL;
+int globScratchNamesCap = 0;
+char **globMatches = NULL;
+int globMatchCount = 0;
+int globMatchCap = 0;
+
+
+
+// True if `word` is a pattern. "$?" isn't, neither is a '[' without a ']' after it, e.g. `[`
+bool word_has_glob(const char *word) {
+    for (const char *c = word; *c != '\0'; c++) {
+        if (*c == '*' || (*c == '?' && (c == word || c[-1] != '$'))) return true;
+        if (*c == '[' && strchr(c + 1, ']') != NULL) return true;
+    }
+    return false;
+}
+
+
+
+// Forgets every scanned directory
+void glob_cache_reset() {
+    if (globDirs == NULL) return;
+    globDirs = NULL;
+    arena_reset(&globArena);
+}
+
+
+
+int compare_glob_names(const void *a, const void *b) {
+    return strcmp(((const GlobName *)a)->name, ((const GlobName *)b)->name);
+}
+
+
+
+// Listing of the directory `path` ("" for the working directory), scanned on first use. NULL if
+// it can't be read
+GlobDir* glob_scan(const char *path) {
+    for (GlobDir *dir = globDirs; dir != NULL; dir = dir->next) {
+        if (strcmp(dir->path, path) == 0) return dir->names != NULL ? dir : NULL;
+    }
+
+    GlobDir *dir = arena_alloc(&globArena, sizeof(GlobDir));
+    dir->path = arena_strndup(&globArena, path, strlen(path));
+    dir->names = NULL;
+    dir->count = 0;
+    dir->next = globDirs;
+    globDirs = dir; // Failures are cached too
+
+    int fd = open(path[0] != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    char buffer[GLOB_SCAN_BUFFER] __attribute__((aligned(8)));
+    int count = 0;
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+        for (long pos = 0; pos < n; ) {
+            GlobDirent *entry = (GlobDirent *)(buffer + pos);
+            pos += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (count == globScratchNamesCap) {
+                globScratchNamesCap = globScratchNamesCap ? globScratchNamesCap * 2 : 256;
+                globScratchNames = realloc(globScratchNames, globScratchNamesCap * sizeof(GlobName));
+                if (globScratchNames == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            globScratchNames[count].name = arena_strndup(&globArena, name, strlen(name));
+            globScratchNames[count].type = entry->d_type;
+            count++;
+        }
+    }
+    close(fd);
+
+    qsort(globScratchNames, count, sizeof(GlobName), compare_glob_names);
+    dir->names = arena_alloc(&globArena, count * sizeof(GlobName) + 1);
+    memcpy(dir->names, globScratchNames, count * sizeof(GlobName));
+    dir->count = count;
+    return dir;
+}
+
+
+
+void glob_add_match(Arena *arena, const char *path, size_t len) {
+    if (globMatchCount == globMatchCap) {
+        globMatchCap = globMatchCap ? globMatchCap * 2 : 64;
+        globMatches = realloc(globMatches, globMatchCap * sizeof(char*));
+        if (globMatches == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    globMatches[globMatchCount++] = arena_strndup(arena, path, len);
+}
+
+
+
+// Matches the components of `rest` under the directory `path` (its first `len` bytes, which end
+// in '/' unless empty), every complete match goes to globMatches as a copy in `arena`
+void glob_walk(Arena *arena, char *path, size_t len, const char *rest) {
+    const char *slash = strchr(rest, '/');
+    size_t componentLen = slash ? (size_t)(slash - rest) : strlen(rest);
+    char component[NAME_MAX + 1];
+    if (componentLen > NAME_MAX) return;
+    memcpy(component, rest, componentLen);
+    component[componentLen] = '\0';
+
+    if (!word_has_glob(component)) {
+        // Literal component: only has to exist
+        if (len + componentLen + 2 > PATH_MAX) return;
+        memcpy(path + len, component, componentLen);
+        size_t end = len + componentLen;
+        path[end] = '\0';
+        struct stat st;
+        if (slash == NULL) {
+            if (lstat(path, &st) == 0) glob_add_match(arena, path, end);
+        } else {
+            path[end] = '/';
+            glob_walk(arena, path, end + 1, slash + 1);
+        }
+        return;
+    }
+
+    path[len] = '\0';
+    GlobDir *dir = glob_scan(path);
+    if (dir == NULL) return;
+    for (int i = 0; i < dir->count; i++) {
+        GlobName *entry = &dir->names[i];
+        if (entry->name[0] == '.' && component[0] != '.') continue; // Hidden unless asked for
+        if (fnmatch(component, entry->name, 0) != 0) continue;
+        size_t nameLen = strlen(entry->name);
+        if (len + nameLen + 2 > PATH_MAX) continue;
+        memcpy(path + len, entry->name, nameLen);
+        size_t end = len + nameLen;
+        path[end] = '\0';
+        if (slash == NULL) {
+            glob_add_match(arena, path, end);
+            continue;
+        }
+        bool isDir = entry->type == DT_DIR;
+        if (entry->type == DT_UNKNOWN || entry->type == DT_LNK) {
+            struct stat st;
+            isDir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (!isDir) continue;
+        path[end] = '/';
+        glob_walk(arena, path, end + 1, slash + 1);
+    }
+}
+
+
+
+int compare_glob_matches(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+
+/**            ####     int glob_expand(Arena *arena, const char *pattern)    ####
+ * 
+ * Expands `pattern` against the filesystem. The matches, sorted, are left in globMatches[0..n)
+ * as strings in `arena`; nothing else is allocated per match.
+ * 
+ * Returns:
+ *   The number of matches, 0 if there are none (the caller keeps the word as it is).
+ */
+int glob_expand(Arena *arena, const char *pattern) {
+    char path[PATH_MAX];
+    size_t len = 0;
+    if (pattern[0] == '/') {
+        path[len++] = '/'; // Absolute: the walk starts at the root
+        while (pattern[0] == '/') pattern++;
+    }
+
+    globMatchCount = 0;
+    glob_walk(arena, path, len, pattern);
+    qsort(globMatches, globMatchCount, sizeof(char*), compare_glob_matches);
+    return globMatchCount;
+}
+
+
+////////#########//////// END GLOB EXPANSION ////////#########////////
+
+
+
+
+
+
+
+////////#########//////// EXTERNAL EXECUTION LOGIC ////////#########////////
+
+
+/**            ####     char* findExecutable(char* command)    ####
+ * 
+ * Attempts to find the full path to an executable command.
+ * 
+ * This function searches for an executable file by the name specified in the `command` parameter.
+ * If the command includes a slash (`/`), it is assumed to be either an absolute or a relative path,
+ * and the function checks the specified path for executability. If no slash is present, the function
+ * iterates through the directories listed in the global `PathList` (globalPathList), constructing
+ * paths by combining each directory with the command name, and checks each for executability.
+ * 
+ * The search respects the order of directories in `globalPathList`, returning the path to the
+ * first executable match found.
+ * 
+ * Parameters:
+ *   command - A string representing the command to find. This can be just the name of the command
+ *             (for example "ls") or a path to the command (either absolute like "/bin/ls" or relative like
+ *             "./give_permissions_to_all_scripts.sh").
+ * 
+ * Returns:
+ *   A dynamically allocated string containing the full path to the executable command if found.
+ *   The caller is responsible for freeing this string using `free`.
+ *   If the command is not found or is not executable, returns NULL.
+ * 
+ * Note:
+ *   The function uses `access()` with the `X_OK` flag to check for the command's executability.
+ *   If `command` contains a slash, it's directly checked without searching `globalPathList`.
+ *   Successful PATH searches are remembered in `globalExecCache`, so repeated commands skip
+ *   the `access()` calls entirely until the `path` builtin (or `hash -r`) clears the cache.
+ *   With --hash-revalidate a hit costs one `stat()` per PATH directory searched instead.
+ */
+char* findExecutable(char* command) {
+    if (strchr(command, '/') != NULL) {
+        // Command already contains a path (absolute or relative)
+        if (access(command, X_OK) == 0) {
+            return strdup(command); // Return the command as is
+        }
+    } else {
+        const char *cached = execCacheLookup(command);
+        if (cached != NULL) {
+            return strdup(cached); // Remembered from an earlier search
+        }
+
+        // Search for the command in the specified paths
+        for (int i = 0; i < globalPathList.count; i++) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", globalPathList.paths[i], command);
+            if (access(path, X_OK) == 0) {
+                execCacheInsert(command, path, i);
+                return strdup(path); // Return the full path to the executable
+            }
+        }
+    }
+    return NULL; // Command not found
+}
+
+
+
+// open() flags of a redirection that names a file
+int redirect_open_flags(RedirectType type) {
+    switch (type) {
+        case REDIRECT_APPEND: return O_WRONLY | O_CREAT | O_APPEND;
+        case REDIRECT_IN:     return O_RDONLY;
+        default:              return O_WRONLY | O_CREAT | O_TRUNC;
+    }
+}
+
+
+
+// Applies redirections to the calling process in the order they were written, so "2>&1 > f"
+// and "> f 2>&1" differ like in other shells. Only open/dup2/close: fork and vfork children
+// and the zygote helpers all use it. Here-strings were already turned into the stdin fd by
+// the parent. Returns -1 if a file couldn't be opened
+int apply_redirects(const Redirect *redirects, int count) {
+    for (int i = 0; i < count; i++) {
+        const Redirect *redirect = &redirects[i];
+        if (redirect->type == REDIRECT_HERE_STRING) continue;
+        if (redirect->type == REDIRECT_DUP) {
+            if (dup2(redirect->target[0] - '0', redirect->fd) == -1) return -1;
+            continue;
+        }
+        int fd = open(redirect->target, redirect_open_flags(redirect->type), 0644);
+        if (fd == -1) return -1;
+        if (fd != redirect->fd) {
+            dup2(fd, redirect->fd);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+
+
+// Here-string of a command, or NULL
+const char* here_string(const Redirect *redirects, int count) {
+    for (int i = 0; i < count; i++) {
+        if (redirects[i].type == REDIRECT_HERE_STRING) return redirects[i].target;
+    }
+    return NULL;
+}
+
+
+
+// memfd holding `text` and a newline, positioned at the start, for a '<<<' stdin. -1 on error
+int here_string_fd(const char *text) {
+    int fd = memfd_create("wish-here-string", MFD_CLOEXEC);
+    if (fd == -1) return -1;
+    size_t len = strlen(text);
+    if (write_all(fd, text, len) == -1 || write_all(fd, "\n", 1) == -1 || lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+
+/**            ####     pid_t spawn_process(const char *path, char **args, const SpawnIO *io)    ####
+ * 
+ * Starts `path` as a new process with the given argument vector. The standard streams of the
+ * child are set up as described by `io`: pipe ends for pipeline stages, then the redirections
+ * of the command, opened once and only in the child. The backend used is chosen at startup
+ * with --spawn:
+ * 
+ *   fork         - fork() + execv(). Copies the page tables of the shell for every command.
+ *   vfork        - vfork() + execv(). The child borrows the shell memory until it execs, so it
+ *                  only does raw syscalls (open/dup2/execv/_exit) before exec.
+ *   posix_spawn  - posix_spawn() with file actions for the redirection. glibc implements it
+ *                  with clone(CLONE_VM|CLONE_VFORK), and reports exec failures back to us.
+ *   zygote       - sent to an idle helper forked ahead of time, which execs right away
+ *                  (see ZYGOTE POOL).
+ * 
+ * Returns:
+ *   The pid of the child, or -1 if it could not be started (an error was already printed).
+ */
+pid_t spawn_with_fork(const char *path, char **args, const SpawnIO *io) {
+    pid_t pid = fork();
+
+    if (pid == 0) { // Child process
+        if (io->stdinFd != -1) dup2(io->stdinFd, STDIN_FILENO);
+        if (io->stdoutFd != -1) dup2(io->stdoutFd, STDOUT_FILENO);
+        if (apply_redirects(io->redirects, io->redirectCount) == -1 || child_limits_apply() == -1) {
+            fprintf(stderr, "An error has occurred\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Execute the command
+        execv(path, args);
+        perror("An error has occurred\n");
+        exit(EXIT_FAILURE);
+    } else if (pid < 0) {
+        perror("An error has occurred\n");
+    }
+    return pid;
+}
+
+
+
+pid_t spawn_with_vfork(const char *path, char **args, const SpawnIO *io) {
+    pid_t pid = vfork();
+
+    if (pid == 0) { // Child process, sharing our memory: no stdio, no malloc, no exit()
+        if (io->stdinFd != -1) dup2(io->stdinFd, STDIN_FILENO);
+        if (io->stdoutFd != -1) dup2(io->stdoutFd, STDOUT_FILENO);
+        if (apply_redirects(io->redirects, io->redirectCount) == 0 && child_limits_apply() == 0) {
+            execv(path, args);
+        }
+        static const char msg[] = "An error has occurred\n";
+        write_all(STDERR_FILENO, msg, sizeof(msg) - 1); // Only write(), safe here; nothing to do if it fails
+        _exit(EXIT_FAILURE);
+    } else if (pid < 0) {
+        perror("An error has occurred\n");
+    }
+    return pid;
+}
+
+
+
+pid_t spawn_with_posix_spawn(const char *path, char **args, const SpawnIO *io) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    // Pipe ends are O_CLOEXEC, the dup2 copies on 0/1 are not, so they survive the exec
+    if (io->stdinFd != -1) posix_spawn_file_actions_adddup2(&actions, io->stdinFd, STDIN_FILENO);
+    if (io->stdoutFd != -1) posix_spawn_file_actions_adddup2(&actions, io->stdoutFd, STDOUT_FILENO);
+    for (int i = 0; i < io->redirectCount; i++) {
+        // Open targets straight onto their fd in the child, same effect as open + dup2
+        const Redirect *redirect = &io->redirects[i];
+        if (redirect->type == REDIRECT_DUP) {
+            posix_spawn_file_actions_adddup2(&actions, redirect->target[0] - '0', redirect->fd);
+        } else if (redirect->type != REDIRECT_HERE_STRING) {
+            posix_spawn_file_actions_addopen(&actions, redirect->fd, redirect->target,
+                                             redirect_open_flags(redirect->type), 0644);
+        }
+    }
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, NULL, args, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        if (debug_mode) printf("Debug: posix_spawn failed: %s\n", strerror(err));
+        fprintf(stderr, "An error has occurred\n");
+        return -1;
+    }
+    return pid;
+}
+
+
+
+pid_t spawn_process(const char *path, char **args, const SpawnIO *io) {
+    fflush(stdout); // Don't let the child inherit (and repeat) pending shell output
+
+    // posix_spawn and the zygote helpers can't apply `ulimit`/`limit` settings, a fork child can
+    if (child_limits.active && (spawn_backend == SPAWN_POSIX_SPAWN || spawn_backend == SPAWN_ZYGOTE)) {
+        return spawn_with_fork(path, args, io);
+    }
+
+    switch (spawn_backend) {
+        case SPAWN_VFORK:
+            return spawn_with_vfork(path, args, io);
+        case SPAWN_POSIX_SPAWN:
+            return spawn_with_posix_spawn(path, args, io);
+        case SPAWN_ZYGOTE:
+            return spawn_with_zygote(path, args, io);
+        case SPAWN_FORK:
+        default:
+            return spawn_with_fork(path, args, io);
+    }
+}
+
+
+
+/**       
+ * Starts an external command with optional redirections, without waiting for it.
+ * 
+ * This function is responsible for starting the command described by `cmd`, as produced by
+ * `parse_line`. The program to execute is `cmd->args[0]`, and any arguments to the command
+ * follow in the array. Its redirections ('>', '>>', '<', '2>', '2>&1', '<<<'...) are applied
+ * by the child right before the exec, so every file is opened exactly once; only the text of a
+ * here-string is put in a memfd here. Malformed commands (a '>' without a file, more than one
+ * file or two redirections of one fd, nothing before the '>') were flagged by the parser and
+ * only produce the error message here.
+ * 
+ * The function first searches for the executable in the filesystem using `findExecutable`, 
+ * which checks both directly specified paths (e.g., "./script.sh" or "/bin/ls") and searches 
+ * the directories listed in the global path list for the executable. It then hands the resolved 
+ * path to `spawn_process`, which creates the child with the configured backend and applies
+ * the redirections in it.
+ * 
+ * The lookup and the spawn are wrapped in probes, so --bench and --trace see how long each took
+ * without the shell printing anything between the commands' own output.
+ * 
+ * @param cmd      The parsed command. Its args array is already NULL terminated for execv.
+ * @param stdinFd  fd the child should use as stdin (a pipeline stage), or -1 to inherit ours.
+ * @param stdoutFd fd the child should use as stdout, or -1. A '>' redirection still wins.
+ * @return     The pid of the started child, or -1 if nothing was started.
+ */
+pid_t start_external_command(SimpleCommand *cmd, int stdinFd, int stdoutFd) {
+    SpawnIO io = { stdinFd, stdoutFd, cmd->redirects, cmd->redirectCount };
+
+    if (cmd->invalid || cmd->argCount == 0) {
+        fprintf(stderr, "An error has occurred\n");
+        return -1; // Return without trying to execute anything
+    }
+
+    uint64_t lookupStart = PROBE_START();
+    char* executablePath = findExecutable(cmd->args[0]);
+    PROBE_END(PHASE_LOOKUP, lookupStart, executablePath != NULL);
+    if (!executablePath) {
+        fprintf(stderr, "An error has occurred\n");
+        return -1;
+    }
+
+    // The only redirection prepared here: the text of a '<<<' becomes the stdin of the child
+    int hereFd = -1;
+    const char *hereText = here_string(cmd->redirects, cmd->redirectCount);
+    if (hereText != NULL && (io.stdinFd = hereFd = here_string_fd(hereText)) == -1) {
+        fprintf(stderr, "An error has occurred\n");
+        free(executablePath);
+        return -1;
+    }
+
+    uint64_t spawnStart = PROBE_START();
+    pid_t pid = spawn_process(executablePath, cmd->args, &io);
+    PROBE_END(PHASE_SPAWN, spawnStart, pid);
+    if (pid > 0) stats_track(pid, cmd->args[0]);
+
+    if (hereFd != -1) close(hereFd);
+    free(executablePath); // Free dynamically allocated path
+    return pid;
+}
+
+
+
+// Executes an external command and waits for it to finish
+void execute_external_command(SimpleCommand *cmd) {
+    pid_t pid = start_external_command(cmd, -1, -1);
+
+    last_status = 1; // Nothing started, the error was already reported
+    if (pid > 0) {
+        // Parent process waits for the child process to complete
+        int status;
+        zygote_refill(); // Replace the helper the command used while it runs
+        uint64_t waitStart = PROBE_START();
+        wait_child(pid, &status, 0);
+        PROBE_END(PHASE_WAIT, waitStart, pid);
+        last_status = exit_code(status);
+    }
+}
+
+
+
+// Runs the builtin `cmd` resolved to (find_builtin) in the shell itself, the exit status goes
+// to builtin_status. Native utilities honour redirections by pointing the shell's own fds at the
+// files while they run, the originals are kept in CLOEXEC copies and put back afterwards
+void run_builtin_command(SimpleCommand *cmd, const Builtin *builtin) {
+    if (cmd->invalid || (cmd->redirectCount > 0 && !builtin->utility)) {
+        fprintf(stderr, "An error has occurred\n"); // Shell builtins can't be redirected
+        builtin_status = 1;
+        return;
+    }
+
+    if (cmd->redirectCount == 0) {
+        run_builtin(builtin, cmd->args, cmd->argCount);
+        return;
+    }
+
+    int saved[REDIRECT_MAX_FD + 1]; // Copy of each redirected fd, -1 if it wasn't open
+    for (int i = 0; i < cmd->redirectCount; i++) saved[i] = -2;
+    fflush(stdout);
+    fflush(stderr);
+    int hereFd = -1;
+    const char *hereText = here_string(cmd->redirects, cmd->redirectCount);
+    bool ok = hereText == NULL || (hereFd = here_string_fd(hereText)) != -1;
+    for (int i = 0; i < cmd->redirectCount && ok; i++) {
+        saved[i] = fcntl(cmd->redirects[i].fd, F_DUPFD_CLOEXEC, REDIRECT_MAX_FD + 1);
+    }
+    if (ok && hereFd != -1) dup2(hereFd, STDIN_FILENO);
+    ok = ok && apply_redirects(cmd->redirects, cmd->redirectCount) == 0;
+
+    if (ok) run_builtin(builtin, cmd->args, cmd->argCount);
+
+    // Put everything back (each fd is redirected once, so the order doesn't matter)
+    for (int i = 0; i < cmd->redirectCount; i++) {
+        if (saved[i] == -2) continue;
+        if (saved[i] == -1) {
+            close(cmd->redirects[i].fd);
+        } else {
+            dup2(saved[i], cmd->redirects[i].fd);
+            close(saved[i]);
+        }
+    }
+    if (hereFd != -1) close(hereFd);
+    if (!ok) {
+        fprintf(stderr, "An error has occurred\n");
+        builtin_status = 1;
+    }
+}
+
+
+
+// Runs one foreground command (a single program or a pipeline) and waits for it
+void execute_command(Pipeline *command) {
+    if (command->invalid) {
+        fprintf(stderr, "An error has occurred\n");
+        last_status = 1;
+    } else if (command->stageCount > 1) {
+        execute_pipeline(command);
+    } else {
+        // Native utilities and programs alike can be skipped by --incremental
+        SimpleCommand *cmd = &command->stages[0];
+        const char *output = incremental ? incremental_output(cmd) : NULL;
+        uint64_t fingerprint = 0;
+        if (output != NULL && incremental_check(cmd, output, &fingerprint)) {
+            last_status = 0; // The file is what this run would write again
+            return;
+        }
+        const Builtin *builtin = find_builtin(cmd->args, cmd->argCount);
+        if (builtin != NULL) {
+            run_builtin_command(cmd, builtin);
+            last_status = builtin_status;
+        } else {
+            execute_external_command(cmd); // Execute if not a built-in command
+        }
+        if (output != NULL && last_status == 0) incremental_record(output, fingerprint);
+    }
+}
+
+
+
+Arena wordArena; // Copies of pipelines with "$?" or patterns expanded, only needed until they started
+
+
+// Copy of `text` (in wordArena) with every "$?" replaced by `status`
+char* expand_status_word(const char *text, const char *status) {
+    size_t statusLen = strlen(status), len = 0;
+    for (const char *c = text; *c != '\0'; c++) {
+        if (c[0] == '$' && c[1] == '?') {
+            len += statusLen;
+            c++;
+        } else {
+            len++;
+        }
+    }
+    char *word = arena_alloc(&wordArena, len + 1), *out = word;
+    for (const char *c = text; *c != '\0'; c++) {
+        if (c[0] == '$' && c[1] == '?') {
+            memcpy(out, status, statusLen);
+            out += statusLen;
+            c++;
+        } else {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+    return word;
+}
+
+
+
+// True if argument `a` of `cmd` is a pattern the command matches itself: the one of
+// `parallel -g`, streamed instead of expanded (wish has no quotes to keep it from the shell)
+bool glob_left_to_command(SimpleCommand *cmd, int a) {
+    if (a < 2 || strcmp(cmd->args[a - 1], "-g") != 0) return false;
+    const Builtin *builtin = builtin_named(cmd->args[0]);
+    return builtin != NULL && builtin->run == builtin_parallel;
+}
+
+
+
+// Returns `pipeline` with "$?" in its words replaced by last_status and every pattern among its
+// arguments replaced by the paths it matches. Pipelines with neither are returned as they are;
+// the others are copied, so the parsed line (maybe a compiled script replayed by --bench) stays
+// intact. A copy lives until the next call
+Pipeline* expand_words(Pipeline *pipeline) {
+    if (!pipeline->usesStatus && !pipeline->usesGlob) return pipeline;
+    arena_reset(&wordArena);
+
+    char status[16];
+    snprintf(status, sizeof(status), "%d", last_status);
+    Pipeline *copy = arena_alloc(&wordArena, sizeof(Pipeline));
+    *copy = *pipeline;
+    copy->stages = arena_alloc(&wordArena, pipeline->stageCount * sizeof(SimpleCommand));
+    for (int st = 0; st < pipeline->stageCount; st++) {
+        SimpleCommand *from = &pipeline->stages[st], *to = &copy->stages[st];
+        *to = *from;
+        int capacity = from->argCount + 1, count = 0;
+        to->args = arena_alloc(&wordArena, capacity * sizeof(char*));
+        for (int a = 0; a < from->argCount; a++) {
+            char *word = from->args[a];
+            if (pipeline->usesStatus && strstr(word, "$?") != NULL) word = expand_status_word(word, status);
+            bool pattern = pipeline->usesGlob && word_has_glob(word) && !glob_left_to_command(from, a);
+            int matches = pattern ? glob_expand(&wordArena, word) : 0;
+            if (matches == 0) {
+                to->args[count++] = word; // Not a pattern, or one matching nothing
+                continue;
+            }
+            if (count + matches + (from->argCount - a) > capacity) {
+                capacity = count + matches + (from->argCount - a);
+                char **args = arena_alloc(&wordArena, capacity * sizeof(char*));
+                memcpy(args, to->args, count * sizeof(char*));
+                to->args = args;
+            }
+            memcpy(to->args + count, globMatches, matches * sizeof(char*));
+            count += matches;
+        }
+        to->args[count] = NULL;
+        to->argCount = count;
+        if (!pipeline->usesStatus) continue; // Redirections stay as they are
+
+        to->redirects = arena_alloc(&wordArena, from->redirectCount * sizeof(Redirect) + 1);
+        for (int r = 0; r < from->redirectCount; r++) {
+            to->redirects[r] = from->redirects[r];
+            if (strstr(from->redirects[r].target, "$?") != NULL) {
+                to->redirects[r].target = expand_status_word(from->redirects[r].target, status);
+            }
+        }
+    }
+    return copy;
+}
+
+
+
+// Runs an and-or list in the foreground: every pipeline after a '&&' runs only if the one before
+// succeeded, after a '||' only if it failed. Skipped pipelines leave last_status alone, so in
+// "false && a || b" b sees the status of false
+void execute_and_or(Pipeline *command) {
+    while (command != NULL) {
+        execute_command(expand_words(command));
+        glob_cache_reset(); // It may have created or removed files the next one looks for
+
+        PipelineLink link = command->link;
+        command = command->next;
+        while (command != NULL && (link == LINK_AND) != (last_status == 0)) {
+            link = command->link; // Skipped, the decision goes on to its own link
+            command = command->next;
+        }
+    }
+}
+
+
+
+
+////////#########//////// PIPELINE LOGIC ////////#########////////
+
+
+#define SPLICE_CHUNK (1 << 16) // Max bytes moved per splice()/tee() call
+
+
+// Returns true if fd is a pipe (or FIFO), the only kind of fd tee() works on
+bool fd_is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+
+
+// Plain read/write copy loop, used when splice() can't handle the fds (ttys, sockets...)
+int copy_stream(int inFd, int outFd, int teeFd) {
+    char buffer[SPLICE_CHUNK];
+    for (;;) {
+        ssize_t n = read(inFd, buffer, sizeof(buffer));
+        if (n == 0) return 0;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        int targets[2] = { outFd, teeFd };
+        for (int t = 0; t < 2; t++) {
+            if (targets[t] == -1) continue;
+            for (ssize_t done = 0; done < n; ) {
+                ssize_t w = write(targets[t], buffer + done, n - done);
+                if (w < 0) {
+                    if (errno == EINTR) continue;
+                    return -1;
+                }
+                done += w;
+            }
+        }
+    }
+}
+
+
+
+// Writes everything a captured command left in the memfd `captureFd` to `outFd` and closes
+// it. sendfile() moves the pages without a copy through user space
+void send_captured(int captureFd, int outFd) {
+    struct stat st;
+    off_t offset = 0;
+    if (fstat(captureFd, &st) == 0) {
+        while (offset < st.st_size) {
+            ssize_t sent = sendfile(outFd, captureFd, &offset, st.st_size - offset);
+            if (sent > 0) continue;
+            if (sent == -1 && errno == EINTR) continue;
+            break;
+        }
+    }
+    if (offset < st.st_size && lseek(captureFd, offset, SEEK_SET) != -1) {
+        copy_stream(captureFd, outFd, -1); // sendfile() refused the target, copy the rest
+    }
+    close(captureFd);
+}
+
+
+
+
+#define PREFIX_IOV_BATCH 64 // iovecs per writev() when tagging captured lines
+
+
+// writev() that retries until every iovec was written. `iov` is consumed
+void writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+
+
+// Like send_captured(), but every line goes out as "[number] line". The memfd is mapped and
+// the lines are written in place with writev(), the only copies are the prefixes
+void send_prefixed(int captureFd, int outFd, int number) {
+    struct stat st;
+    char *data = MAP_FAILED;
+    if (fstat(captureFd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, captureFd, 0);
+    }
+    if (data != MAP_FAILED) {
+        char prefix[24];
+        int prefixLen = snprintf(prefix, sizeof(prefix), "[%d] ", number);
+        struct iovec iov[PREFIX_IOV_BATCH];
+        int count = 0;
+        size_t size = st.st_size;
+
+        for (size_t pos = 0; pos < size; ) {
+            char *newline = memchr(data + pos, '\n', size - pos);
+            size_t lineLen = newline ? (size_t)(newline - (data + pos)) + 1 : size - pos;
+            iov[count++] = (struct iovec){ prefix, prefixLen };
+            iov[count++] = (struct iovec){ data + pos, lineLen };
+            if (newline == NULL) iov[count++] = (struct iovec){ "\n", 1 }; // Unterminated last line
+            pos += lineLen;
+            if (count > PREFIX_IOV_BATCH - 3 || pos >= size) {
+                writev_all(outFd, iov, count);
+                count = 0;
+            }
+        }
+        munmap(data, size);
+    }
+    close(captureFd);
+}
+
+
+
+// Moves everything from inFd to outFd. As long as one side is a pipe, splice() moves the
+// pages inside the kernel, so the data never passes through user space
+int forward_stream(int inFd, int outFd) {
+    for (;;) {
+        ssize_t n = splice(inFd, NULL, outFd, NULL, SPLICE_CHUNK, SPLICE_F_MOVE);
+        if (n > 0) continue;
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        if (errno == EINVAL) return copy_stream(inFd, outFd, -1); // Not spliceable
+        return -1;
+    }
+}
+
+
+
+// Copies everything from inFd to both outFd and fileFd. tee() duplicates the pipe contents
+// into the next stage without consuming them, then splice() drains the same bytes into the file
+int tee_stream(int inFd, int outFd, int fileFd) {
+    if (!fd_is_pipe(inFd) || !fd_is_pipe(outFd)) {
+        return copy_stream(inFd, outFd, fileFd); // tee() needs a pipe on both sides
+    }
+    for (;;) {
+        ssize_t n = tee(inFd, outFd, SPLICE_CHUNK, 0);
+        if (n == 0) return 0;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0) {
+            ssize_t moved = splice(inFd, NULL, fileFd, NULL, n, SPLICE_F_MOVE);
+            if (moved < 0 && errno == EINTR) continue;
+            if (moved <= 0) return -1;
+            n -= moved;
+        }
+    }
+}
+
+
+
+// Returns true for the stages the shell can run itself: a bare `cat` or `tee FILE`
+bool is_splice_stage(SimpleCommand *stage) {
+    if (!splice_fast_path || stage->invalid || stage->redirectCount > 0) return false;
+    if (strcmp(stage->args[0], "cat") == 0) {
+        return stage->argCount == 1;
+    }
+    if (strcmp(stage->args[0], "tee") == 0) {
+        return stage->argCount == 2 && stage->args[1][0] != '-';
+    }
+    return false;
+}
+
+
+
+/**            ####     pid_t start_pipeline_stage(SimpleCommand *stage, int inFd, int outFd, int unusedFd)    ####
+ * 
+ * Starts one stage of a pipeline reading from `inFd` and writing to `outFd` (-1 means the
+ * shell's own stdin/stdout). `unusedFd` is the read end of the pipe this stage writes to: the
+ * children we fork without exec must close it by hand, otherwise a writer would never see
+ * EPIPE when the next stage exits early. Exec'd children lose it through O_CLOEXEC.
+ * 
+ * Bare `cat` and `tee FILE` stages don't exec anything: a forked copy of the shell moves the
+ * data with splice()/tee(). Builtins run in a forked child too. Everything else goes through
+ * start_external_command and therefore the configured spawn backend.
+ */
+pid_t start_pipeline_stage(SimpleCommand *stage, int inFd, int outFd, int unusedFd) {
+    bool spliceStage = is_splice_stage(stage);
+    const Builtin *builtin = spliceStage ? NULL : find_builtin(stage->args, stage->argCount);
+
+    if (!spliceStage && builtin == NULL) {
+        return start_external_command(stage, inFd, outFd);
+    }
+
+    fflush(stdout); // Same as in spawn_process
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("An error has occurred\n");
+        return -1;
+    }
+    if (pid > 0) return pid;
+
+    // Child process
+    if (unusedFd != -1) close(unusedFd);
+    int in = inFd != -1 ? inFd : STDIN_FILENO;
+    int out = outFd != -1 ? outFd : STDOUT_FILENO;
+
+    if (!spliceStage) {
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        run_builtin_command(stage, builtin);
+        exit(builtin_status);
+    }
+
+    int result;
+    if (strcmp(stage->args[0], "tee") == 0) {
+        int fileFd = open(stage->args[1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fileFd == -1) {
+            fprintf(stderr, "An error has occurred\n");
+            _exit(EXIT_FAILURE);
+        }
+        result = tee_stream(in, out, fileFd);
+    } else {
+        result = forward_stream(in, out);
+    }
+    _exit(result == 0 ? 0 : EXIT_FAILURE);
+}
+
+
+
+/**            ####     int start_pipeline(Pipeline *pipeline, pid_t *pids, int outFd)    ####
+ * 
+ * Starts every stage of a '|' pipeline at once, each stage connected to the next through a
+ * pipe2(O_CLOEXEC) pipe, and returns without waiting.
+ * 
+ * Parameters:
+ *   pipeline - The parsed pipeline, e.g. from "ls -l | grep foo | wc -l".
+ *   pids     - Receives the pid of every started stage, needs pipeline->stageCount slots.
+ *   outFd    - stdout of the last stage, or -1 for the shell's own.
+ * 
+ * Returns:
+ *   The number of pids stored. If a stage is empty nothing is started and an error is printed.
+ */
+int start_pipeline(Pipeline *pipeline, pid_t *pids, int outFd) {
+    if (pipeline->invalid) {
+        fprintf(stderr, "An error has occurred\n");
+        return 0;
+    }
+
+    int started = 0;
+    int prevRead = -1; // Read end of the pipe coming from the previous stage
+    for (int i = 0; i < pipeline->stageCount; i++) {
+        int pipefd[2] = { -1, -1 };
+        bool last = (i == pipeline->stageCount - 1);
+        if (!last && pipe2(pipefd, O_CLOEXEC) == -1) {
+            perror("An error has occurred\n");
+            break;
+        }
+
+        pid_t pid = start_pipeline_stage(&pipeline->stages[i], prevRead, last ? outFd : pipefd[1], pipefd[0]);
+        if (pid > 0) pids[started++] = pid;
+
+        // The children hold their own copies now
+        if (prevRead != -1) close(prevRead);
+        if (pipefd[1] != -1) close(pipefd[1]);
+        prevRead = pipefd[0];
+    }
+    if (prevRead != -1) close(prevRead); // Only left open if we stopped early
+
+    return started;
+}
+
+
+
+// Runs a pipeline and waits for all of its stages
+void execute_pipeline(Pipeline *pipeline) {
+    pid_t *pids = malloc(pipeline->stageCount * sizeof(pid_t));
+    if (pids == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t pipelineStart = PROBE_START();
+    int started = start_pipeline(pipeline, pids, -1);
+    last_status = 1; // Unless the last stage started, its status is the pipeline's
+    zygote_refill();
+    for (int i = 0; i < started; i++) {
+        int status;
+        uint64_t waitStart = PROBE_START();
+        wait_child(pids[i], &status, 0);
+        PROBE_END(PHASE_WAIT, waitStart, pids[i]);
+        if (started == pipeline->stageCount && i == started - 1) last_status = exit_code(status);
+    }
+    PROBE_END(PHASE_PIPELINE, pipelineStart, pipeline->stageCount);
+    free(pids);
+}
+
+
+////////#########//////// END PIPELINE LOGIC ////////#########////////
+
+
+
+// Starts one command of a parallel line, storing the pid of every process it started in
+// `pids` (one per pipeline stage). Its stdout goes to `outFd` (-1 for the shell's own).
+// Returns how many were started
+int start_parallel_command(Pipeline *command, pid_t *pids, int outFd) {
+    if (command->next != NULL) {
+        // An and-or list decides as it goes, so it runs in a sub-shell of its own
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (outFd != -1) dup2(outFd, STDOUT_FILENO);
+            execute_and_or(command);
+            fflush(stdout);
+            exit(last_status);
+        } else if (pid < 0) {
+            perror("Fork failed");
+            exit(EXIT_FAILURE);
+        }
+        pids[0] = pid;
+        return 1;
+    }
+
+    command = expand_words(command);
+    if (command->invalid || command->stageCount > 1) {
+        return start_pipeline(command, pids, outFd);
+    }
+
+    SimpleCommand *cmd = &command->stages[0];
+    const Builtin *builtin = find_builtin(cmd->args, cmd->argCount);
+    if (builtin == NULL) {
+        // External commands are spawned straight from the shell, no intermediate fork
+        pids[0] = start_external_command(cmd, -1, outFd);
+        return pids[0] > 0 ? 1 : 0;
+    }
+
+    // Builtins still run in their own child, so they don't affect the shell itself
+    fflush(stdout); // Same as in spawn_process
+    pid_t pid = fork();
+    
+    if (pid == 0) { // Child process
+        if (outFd != -1) dup2(outFd, STDOUT_FILENO);
+        run_builtin_command(cmd, builtin);
+        exit(builtin_status); // Exit after execution
+    } else if (pid < 0) {
+        perror("Fork failed");
+        exit(EXIT_FAILURE); // Forking failed
+    }
+    pids[0] = pid;
+    return 1;
+}
+
+
+
+// A child started by the parallel scheduler and the command (job) it belongs to
+typedef struct {
+    pid_t pid;
+    int command;
+    bool last; // Last stage of its command, the one whose status the command reports
+} RunningChild;
+
+
+
+// --parallel-output: `command` just finished, write out what may go now. Commands from
+// `started` on weren't started yet
+void flush_parallel_output(int *captures, const int *outstanding, int command, int started, int *nextOutput) {
+    if (parallel_output == OUTPUT_PREFIX) {
+        if (captures[command] != -1) send_prefixed(captures[command], STDOUT_FILENO, command + 1);
+        captures[command] = -1;
+        return;
+    }
+    // Ordered: only the finished commands at the front
+    while (*nextOutput < started && outstanding[*nextOutput] == 0) {
+        if (captures[*nextOutput] != -1) send_captured(captures[*nextOutput], STDOUT_FILENO);
+        captures[*nextOutput] = -1;
+        (*nextOutput)++;
+    }
+}
+
+
+
+/**            ####     void execute_commands_in_parallel(CommandLine *line)    ####
+ * 
+ * Runs the '&' separated commands of one line concurrently and returns once all of them finished.
+ * 
+ * The commands are driven by a small job scheduler: at most `max_parallel_jobs` commands are
+ * running at any time (0 means no limit, which is the default so every command of the line
+ * really runs at the same time, as the shell specification asks). Completion is collected with
+ * `waitpid(-1, ...)`, so as soon as any command exits its slot is handed to the next pending
+ * command instead of waiting behind the slowest earlier PID. A pipeline counts as one command
+ * and frees its slot once all of its stages are done. Children of background jobs (--background)
+ * that this collects are handed over to the job table.
+ * 
+ * With --parallel-output=ordered|prefix the stdout of every command goes to its own memfd
+ * instead of ours, so the output of different commands can't interleave. In ordered mode a
+ * command's output is written (sendfile, no copy) once it and every command before it finished;
+ * in prefix mode as soon as it finishes, every line tagged with the command number.
+ * 
+ * The job table lives on the heap, so lines with hundreds of commands don't grow the stack.
+ */
+void execute_commands_in_parallel(CommandLine *line) {
+    Pipeline *commands = line->commands;
+    int num_commands = line->commandCount;
+    uint64_t parallelStart = PROBE_START();
+
+    int limit = (max_parallel_jobs > 0 && max_parallel_jobs < num_commands) ? max_parallel_jobs : num_commands;
+    int childCapacity = limit;
+    RunningChild *children = malloc(childCapacity * sizeof(RunningChild)); // live child table
+    int *outstanding = calloc(num_commands, sizeof(int)); // live children of each command
+    int *captures = NULL; // memfd holding the stdout of each command, -1 when not captured
+    if (parallel_output != OUTPUT_DIRECT) captures = malloc(num_commands * sizeof(int));
+    if (children == NULL || outstanding == NULL || (parallel_output != OUTPUT_DIRECT && captures == NULL)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int next = 0;        // next command waiting to be started
+    int active = 0;      // number of commands with live children
+    int childCount = 0;  // number of entries used in children
+    pid_t *stagePids = NULL; // scratch buffer for the pids of one command
+    int stagePidCapacity = 0;
+    int nextOutput = 0;  // first command whose captured output wasn't written yet
+    int lineStatus = 1;  // Stays if the last command can't be started. last_status keeps the
+                         // previous line's until the end, for "$?" in the commands
+
+    while (next < num_commands || active > 0) {
+        // Fill every free slot
+        while (active < limit && next < num_commands) {
+            int stages = commands[next].stageCount;
+            if (childCount + stages > childCapacity) {
+                childCapacity = (childCount + stages) * 2;
+                children = realloc(children, childCapacity * sizeof(RunningChild));
+                if (children == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (stages > stagePidCapacity) {
+                stagePidCapacity = stages;
+                stagePids = realloc(stagePids, stagePidCapacity * sizeof(pid_t));
+                if (stagePids == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            int capture = -1;
+            if (captures != NULL) {
+                // Falls back to our stdout if the memfd can't be created
+                capture = captures[next] = memfd_create("wish-output", MFD_CLOEXEC);
+            }
+            spawn_cpu_slot = next; // Which CPU it gets under `limit spread`
+            int started = start_parallel_command(&commands[next], stagePids, capture);
+            spawn_cpu_slot = -1;
+            // An and-or list is one sub-shell. Like execute_pipeline(), a pipeline that
+            // stopped early has no last stage and keeps status 1
+            bool whole = commands[next].next != NULL || started == stages;
+            for (int k = 0; k < started; k++) {
+                children[childCount].pid = stagePids[k];
+                children[childCount].command = next;
+                children[childCount].last = whole && k == started - 1;
+                childCount++;
+            }
+            outstanding[next] = started;
+            if (started > 0) active++;
+            next++;
+            if (started == 0 && captures != NULL) {
+                flush_parallel_output(captures, outstanding, next - 1, next, &nextOutput);
+            }
+        }
+        if (active == 0) break;
+        zygote_refill();
+
+        // Wait for whichever child finishes first
+        int status;
+        uint64_t waitStart = PROBE_START();
+        pid_t done = wait_child(-1, &status, 0);
+        PROBE_END(PHASE_WAIT, waitStart, done);
+        if (done == -1) {
+            if (errno == EINTR) continue;
+            break; // No children left to wait for
+        }
+
+        int c = 0;
+        while (c < childCount && children[c].pid != done) c++;
+        if (c == childCount) {
+            job_child_exited(done, status); // Child of a background job, not of this line
+            continue;
+        }
+
+        int command = children[c].command;
+        if (command == num_commands - 1 && children[c].last) {
+            lineStatus = exit_code(status); // A line reports the last stage of its last command
+        }
+        // Drop the entry by moving the last one into its place
+        children[c] = children[--childCount];
+        if (--outstanding[command] == 0) {
+            active--; // Whole command finished, its slot is free
+            if (captures != NULL) flush_parallel_output(captures, outstanding, command, next, &nextOutput);
+        }
+    }
+
+    if (captures != NULL) {
+        // Only left over if waitpid() failed, write out whatever is there
+        for (int i = nextOutput; i < next; i++) {
+            if (captures[i] != -1) send_captured(captures[i], STDOUT_FILENO);
+        }
+        free(captures);
+    }
+    free(children);
+    free(outstanding);
+    free(stagePids);
+    last_status = lineStatus;
+    PROBE_END(PHASE_PARALLEL, parallelStart, num_commands);
+}
+
+
+
+
+////////#########//////// END EXTERNAL EXECUTION LOGIC ////////#########////////
+
+
+
+
+
+
+////////#########//////// INPUT READER ////////#########////////
+
+
+#define READER_BUFFER_SIZE (1 << 20)   // Initial read() buffer for pipes and terminals
+#define READER_DROP_WINDOW (64 << 20)  // Release mapped script pages every this many bytes
+
+
+// Hands out the input one line at a time as pointer/length views, without copying.
+// Regular files are mmap'd whole; pipes, terminals and anything else go through a big
+// read() buffer instead of stdio
+typedef struct {
+    int fd;
+    char *map;          // Mapped script, or NULL in streaming mode
+    size_t mapSize;
+    size_t mapPos;      // Start of the next line in the mapping
+    size_t dropped;     // Mapping bytes already given back with MADV_DONTNEED
+    char *buf;          // Streaming buffer
+    size_t bufCap;
+    size_t bufStart;    // Start of the next line in buf
+    size_t bufEnd;      // End of the valid data in buf
+    bool eof;
+} LineReader;
+
+
+LineReader *shellInput = NULL; // Reader of the main loop, builtins reading stdin go on from it
+
+
+
+// Maps a whole file read-only. Returns NULL on error; an empty file gives a NULL map with size 0
+char* map_file(const char *path, size_t *size, bool *failed) {
+    *size = 0;
+    *failed = true;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    *failed = false;
+    if (st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid
+    if (data == MAP_FAILED) {
+        *failed = true;
+        return NULL;
+    }
+    *size = st.st_size;
+    return data;
+}
+
+
+
+// Sets a reader up to stream an fd from its current offset, whatever kind of file it is
+void line_reader_stream(LineReader *reader, int fd) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->bufCap = READER_BUFFER_SIZE;
+    reader->buf = malloc(reader->bufCap);
+    if (reader->buf == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+
+// Sets a reader up on an open fd. Regular files are mapped, everything else is streamed
+void line_reader_init(LineReader *reader, int fd) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL); // Aggressive read-ahead, we only go forward
+            reader->map = data;
+            reader->mapSize = st.st_size;
+            if (debug_mode) printf("Debug: Input mapped (%zu bytes)\n", reader->mapSize);
+            return;
+        }
+    }
+    line_reader_stream(reader, fd);
+}
+
+
+
+// Returns the next line (without its '\n') in *line / *len. The view stays valid until the
+// next call. Returns false at the end of the input
+bool line_reader_next(LineReader *reader, const char **line, size_t *len) {
+    if (reader->map != NULL) {
+        if (reader->mapPos >= reader->mapSize) return false;
+
+        // Long scripts: give the pages we are done with back, so RSS doesn't grow with the file
+        if (reader->mapPos - reader->dropped >= READER_DROP_WINDOW) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t upTo = reader->mapPos & ~(page - 1);
+            madvise(reader->map + reader->dropped, upTo - reader->dropped, MADV_DONTNEED);
+            reader->dropped = upTo;
+        }
+
+        const char *start = reader->map + reader->mapPos;
+        const char *newline = memchr(start, '\n', reader->mapSize - reader->mapPos);
+        *line = start;
+        *len = newline ? (size_t)(newline - start) : reader->mapSize - reader->mapPos;
+        reader->mapPos += *len + (newline ? 1 : 0);
+        return true;
+    }
+
+    for (;;) {
+        size_t available = reader->bufEnd - reader->bufStart;
+        char *start = reader->buf + reader->bufStart;
+        char *newline = memchr(start, '\n', available);
+        if (newline != NULL) {
+            *line = start;
+            *len = newline - start;
+            reader->bufStart += *len + 1;
+            return true;
+        }
+        if (reader->eof) {
+            if (available == 0) return false;
+            *line = start; // Last line without a trailing '\n'
+            *len = available;
+            reader->bufStart = reader->bufEnd;
+            return true;
+        }
+
+        // Need more data: slide the partial line to the front, grow if it fills the buffer
+        if (reader->bufStart > 0) {
+            memmove(reader->buf, start, available);
+            reader->bufStart = 0;
+            reader->bufEnd = available;
+        }
+        if (reader->bufEnd == reader->bufCap) {
+            reader->bufCap *= 2;
+            reader->buf = realloc(reader->buf, reader->bufCap);
+            if (reader->buf == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ssize_t n = read(reader->fd, reader->buf + reader->bufEnd, reader->bufCap - reader->bufEnd);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            reader->eof = true;
+        } else {
+            reader->bufEnd += n;
+        }
+    }
+}
+
+
+
+void line_reader_close(LineReader *reader) {
+    if (reader->map != NULL) munmap(reader->map, reader->mapSize);
+    free(reader->buf);
+    if (reader->fd != STDIN_FILENO) close(reader->fd);
+}
+
+
+////////#########//////// END INPUT READER ////////#########////////
+
+
+
+
+
+
+////////#########//////// PARALLEL MAP ////////#########////////
+
+
+// `parallel` (alias `map`) runs a command once per input argument, like `xargs -P`:
+//
+//   parallel [-j SLOTS] [-n ARGS] [-a FILE | -g PATTERN] command [args...]
+//
+// Arguments are one per line from stdin (the lines after it, when the shell reads its commands
+// from stdin) or FILE, or the names matching a glob PATTERN. They are read as the workers need
+// them and every command is started straight into a free slot, so a fan-out over thousands of
+// files runs at SLOTS commands at a time (default --max-jobs, or one per CPU) with memory that
+// doesn't grow with the input. A "{}" in a word of the template is
+// replaced by the argument; with -n each word holding "{}" is repeated for every argument of
+// the batch. Without any "{}" the arguments go at the end, as with xargs.
+// The exit status is 0 if every command succeeded, 123 if one failed and 127 if the program
+// couldn't be started (nothing more is started then)
+
+Arena parallelArena; // Batch and argv of the command being started, reset after each spawn
+
+
+// Where the arguments come from
+typedef struct {
+    LineReader *reader;  // shellInput, or `own` for -a FILE and a stdin the shell doesn't read
+    LineReader own;
+    glob_t matches;      // -g PATTERN, in sorted order
+    size_t nextMatch;
+    bool useGlob;
+} MapInput;
+
+
+
+// Next argument as a view valid until the following call. Empty lines are skipped
+bool map_input_next(MapInput *input, const char **arg, size_t *len) {
+    if (input->useGlob) {
+        if (input->nextMatch >= input->matches.gl_pathc) return false;
+        *arg = input->matches.gl_pathv[input->nextMatch++];
+        *len = strlen(*arg);
+        return true;
+    }
+    while (line_reader_next(input->reader, arg, len)) {
+        if (*len > 0) return true;
+    }
+    return false;
+}
+
+
+
+// Copy of `word` with every "{}" replaced by `arg`
+char* map_replace(const char *word, const char *arg) {
+    size_t argLen = strlen(arg), size = 1;
+    for (const char *c = word; *c; c++) {
+        size += (c[0] == '{' && c[1] == '}') ? argLen : 1;
+    }
+    char *result = arena_alloc(&parallelArena, size);
+    char *out = result;
+    for (const char *c = word; *c; c++) {
+        if (c[0] == '{' && c[1] == '}') {
+            memcpy(out, arg, argLen);
+            out += argLen;
+            c++;
+        } else {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+    return result;
+}
+
+
+
+// Builds the argv of one batch in parallelArena, its length goes to *count
+char** map_build_args(char **template, int templateCount, char **batch, int batchCount, int *count) {
+    bool placeholder = false;
+    int total = 0;
+    for (int i = 0; i < templateCount; i++) {
+        bool holds = strstr(template[i], "{}") != NULL;
+        placeholder |= holds;
+        total += holds ? batchCount : 1;
+    }
+    if (!placeholder) total += batchCount;
+
+    char **args = arena_alloc(&parallelArena, (total + 1) * sizeof(char*));
+    int n = 0;
+    for (int i = 0; i < templateCount; i++) {
+        if (strstr(template[i], "{}") == NULL) {
+            args[n++] = template[i];
+            continue;
+        }
+        for (int b = 0; b < batchCount; b++) args[n++] = map_replace(template[i], batch[b]);
+    }
+    for (int b = 0; !placeholder && b < batchCount; b++) args[n++] = batch[b];
+    args[n] = NULL;
+    *count = n;
+    return args;
+}
+
+
+
+// Value of option args[*i] ("-j4" or "-j 4"), NULL if it is missing
+const char* map_option_value(char **args, int arg_count, int *i) {
+    if (args[*i][2] != '\0') return args[*i] + 2;
+    if (*i + 1 >= arg_count) return NULL;
+    return args[++*i];
+}
+
+
+
+// Parses the count of -j/-n into *count. Returns false unless it is a whole number from 1 up
+bool map_option_count(const char *value, int *count) {
+    char *end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE || number < 1 || number > INT_MAX) return false;
+    *count = (int)number;
+    return true;
+}
+
+
+
+int builtin_parallel(char **args, int arg_count) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int slots = max_parallel_jobs > 0 ? max_parallel_jobs : (cpus > 0 ? (int)cpus : 1);
+    int batchSize = 1;
+    const char *inputFile = NULL;
+    const char *pattern = NULL;
+
+    int i = 1;
+    bool ok = true;
+    for (; i < arg_count && args[i][0] == '-' && ok; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        char option = args[i][1];
+        const char *value = map_option_value(args, arg_count, &i);
+        if (value == NULL) {
+            ok = false;
+        } else if (option == 'j') {
+            ok = map_option_count(value, &slots);
+        } else if (option == 'n') {
+            ok = map_option_count(value, &batchSize);
+        } else if (option == 'a') {
+            inputFile = value;
+        } else if (option == 'g') {
+            pattern = value;
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok || i >= arg_count || (inputFile != NULL && pattern != NULL)) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    char **template = &args[i];
+    int templateCount = arg_count - i;
+
+    MapInput input;
+    memset(&input, 0, sizeof(input));
+    if (pattern != NULL) {
+        int result = glob(pattern, 0, NULL, &input.matches);
+        if (result != 0 && result != GLOB_NOMATCH) {
+            fprintf(stderr, "An error has occurred\n");
+            return 1;
+        }
+        input.useGlob = true;
+    } else if (inputFile != NULL) {
+        int fd = open(inputFile, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "An error has occurred\n");
+            return 1;
+        }
+        line_reader_init(&input.own, fd);
+        input.reader = &input.own;
+    } else if (shellInput != NULL && shellInput->fd == STDIN_FILENO) {
+        input.reader = shellInput; // The rest of the script, the shell goes on after it
+    } else {
+        line_reader_stream(&input.own, STDIN_FILENO); // From where stdin is, not its start
+        input.reader = &input.own;
+    }
+
+    pid_t *workers = calloc(slots, sizeof(pid_t)); // pid running in each slot, 0 when free
+    char **batch = malloc(batchSize * sizeof(char*));
+    if (workers == NULL || batch == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int result = 0;
+    int running = 0;
+    int freeSlot = 0; // Lowest slot that may be free
+    bool more = true;
+    while (more || running > 0) {
+        // Fill every free slot with the next batch
+        while (more && running < slots) {
+            const char *arg;
+            size_t len;
+            int batchCount = 0;
+            while (batchCount < batchSize && (more = map_input_next(&input, &arg, &len))) {
+                batch[batchCount++] = arena_strndup(&parallelArena, arg, len);
+            }
+            if (batchCount == 0) break;
+
+            SimpleCommand cmd;
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.args = map_build_args(template, templateCount, batch, batchCount, &cmd.argCount);
+            while (workers[freeSlot] != 0) freeSlot++;
+            spawn_cpu_slot = freeSlot; // Which CPU it gets under `limit spread`
+            pid_t pid = start_external_command(&cmd, -1, -1);
+            spawn_cpu_slot = -1;
+            arena_reset(&parallelArena); // The child has its own copy of the arguments now
+            if (pid <= 0) {
+                result = 127;
+                more = false;
+                break;
+            }
+            workers[freeSlot] = pid;
+            running++;
+        }
+        if (running == 0) break;
+        zygote_refill();
+
+        int status;
+        uint64_t waitStart = PROBE_START();
+        pid_t done = wait_child(-1, &status, 0);
+        PROBE_END(PHASE_WAIT, waitStart, done);
+        if (done == -1) {
+            if (errno == EINTR) continue;
+            break; // No children left to wait for
+        }
+        int slot = 0;
+        while (slot < slots && workers[slot] != done) slot++;
+        if (slot == slots) {
+            job_child_exited(done, status); // Child of a background job
+            continue;
+        }
+        workers[slot] = 0;
+        running--;
+        if (slot < freeSlot) freeSlot = slot;
+        if (exit_code(status) != 0 && result == 0) result = 123;
+    }
+
+    if (input.useGlob) {
+        globfree(&input.matches);
+    } else if (input.reader == &input.own) {
+        line_reader_close(&input.own);
+    }
+    free(workers);
+    free(batch);
+    return result;
+}
+
+
+////////#########//////// END PARALLEL MAP ////////#########////////
+
+
+
+
+
+
+
+////////#########//////// SCRIPT COMPILE CACHE ////////#########////////
+
+
+/*
+ * With --compile-cache a batch script is parsed once into a compact binary form, stored in the
+ * cache dir under the hash of the script contents. Later runs of the unchanged script mmap that
+ * file and rebuild each command tree straight from it, skipping the lexer entirely. Editing the
+ * script changes its hash, so a stale entry is simply never looked up again.
+ * 
+ * File layout (native byte order, all integers are uint32 unless noted):
+ *   CompiledHeader
+ *   for every line:     commandCount, background
+ *     for every command:  each pipeline of its and-or list in turn,
+ *                         stageCount, invalid, usesStatus, usesGlob,
+ *                         link (LINK_NONE ends the list)
+ *       for every stage:    argCount, redirectCount, invalid,
+ *                           argCount strings, then redirectCount x (type, fd, string)
+ *   where a string is its length followed by the bytes and a NUL, so it can be used in place.
+ */
+
+#define COMPILE_CACHE_MAGIC "WSHC"
+#define COMPILE_CACHE_VERSION 5
+
+
+typedef struct {
+    char magic[4];          // COMPILE_CACHE_MAGIC
+    uint32_t version;       // COMPILE_CACHE_VERSION, bumped whenever the layout changes
+    uint64_t sourceHash;    // FNV-1a of the script contents
+    uint64_t sourceSize;    // Size of the script
+    uint64_t payloadHash;   // FNV-1a of everything after the header, catches truncated files
+    uint32_t lineCount;     // Number of line records
+    uint32_t reserved;
+} CompiledHeader;
+
+
+// Growable byte buffer the compiled form is written into
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} ByteBuffer;
+
+
+// Read position inside a compiled script
+typedef struct {
+    const char *pos;
+    const char *end;
+    bool ok;          // Cleared as soon as a read would go past the end
+} CompiledCursor;
+
+
+
+// 64 bit FNV-1a hash, used to key and verify the compiled scripts
+uint64_t fnv1a64(const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+
+void bytebuf_put(ByteBuffer *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t newCap = buf->cap ? buf->cap : 4096;
+        while (newCap < buf->len + len) newCap *= 2;
+        buf->data = realloc(buf->data, newCap);
+        if (buf->data == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        buf->cap = newCap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+
+
+void bytebuf_put_u32(ByteBuffer *buf, uint32_t value) {
+    bytebuf_put(buf, &value, sizeof(value));
+}
+
+
+
+void bytebuf_put_string(ByteBuffer *buf, const char *text) {
+    uint32_t len = strlen(text);
+    bytebuf_put_u32(buf, len);
+    bytebuf_put(buf, text, len + 1); // Keep the NUL so the string can be used from the mapping
+}
+
+
+
+// Appends the compiled form of one pipeline, including its link to the next of its and-or list
+void serialize_pipeline(ByteBuffer *buf, Pipeline *command) {
+    bytebuf_put_u32(buf, command->stageCount);
+    bytebuf_put_u32(buf, command->invalid);
+    bytebuf_put_u32(buf, command->usesStatus);
+    bytebuf_put_u32(buf, command->usesGlob);
+    bytebuf_put_u32(buf, command->link);
+    for (int st = 0; st < command->stageCount; st++) {
+        SimpleCommand *stage = &command->stages[st];
+        bytebuf_put_u32(buf, stage->argCount);
+        bytebuf_put_u32(buf, stage->redirectCount);
+        bytebuf_put_u32(buf, stage->invalid);
+        for (int a = 0; a < stage->argCount; a++) {
+            bytebuf_put_string(buf, stage->args[a]);
+        }
+        for (int r = 0; r < stage->redirectCount; r++) {
+            bytebuf_put_u32(buf, stage->redirects[r].type);
+            bytebuf_put_u32(buf, stage->redirects[r].fd);
+            bytebuf_put_string(buf, stage->redirects[r].target);
+        }
+    }
+}
+
+
+
+// Appends the compiled form of one parsed line
+void serialize_command_line(ByteBuffer *buf, CommandLine *line) {
+    bytebuf_put_u32(buf, line->commandCount);
+    bytebuf_put_u32(buf, line->background);
+    for (int c = 0; c < line->commandCount; c++) {
+        for (Pipeline *command = &line->commands[c]; command != NULL; command = command->next) {
+            serialize_pipeline(buf, command);
+        }
+    }
+}
+
+
+
+uint32_t cursor_u32(CompiledCursor *cur) {
+    uint32_t value = 0;
+    if (!cur->ok || (size_t)(cur->end - cur->pos) < sizeof(value)) {
+        cur->ok = false;
+        return 0;
+    }
+    memcpy(&value, cur->pos, sizeof(value));
+    cur->pos += sizeof(value);
+    return value;
+}
+
+
+
+// Reads an element count. Every element takes at least one byte, so a count larger than the
+// rest of the data can only come from a corrupt file
+int cursor_count(CompiledCursor *cur) {
+    uint32_t count = cursor_u32(cur);
+    if (!cur->ok || count > (size_t)(cur->end - cur->pos) || count > INT_MAX) {
+        cur->ok = false;
+        return 0;
+    }
+    return (int)count;
+}
+
+
+
+// Returns a pointer to a string stored in the compiled data, no copy is made
+char* cursor_string(CompiledCursor *cur) {
+    uint32_t len = cursor_u32(cur);
+    if (!cur->ok || (size_t)(cur->end - cur->pos) < (size_t)len + 1 || cur->pos[len] != '\0') {
+        cur->ok = false;
+        return NULL;
+    }
+    char *text = (char*)cur->pos;
+    cur->pos += len + 1;
+    return text;
+}
+
+
+
+// Reads one pipeline back into `command`. Returns false if the data is corrupt
+bool decode_pipeline(Arena *arena, CompiledCursor *cur, Pipeline *command) {
+    command->stageCount = cursor_count(cur);
+    command->invalid = cursor_u32(cur);
+    command->usesStatus = cursor_u32(cur);
+    command->usesGlob = cursor_u32(cur);
+    command->link = cursor_u32(cur);
+    command->next = NULL;
+    if (command->link > LINK_OR) cur->ok = false;
+    command->stages = arena_alloc(arena, command->stageCount * sizeof(SimpleCommand) + 1);
+
+    for (int st = 0; st < command->stageCount && cur->ok; st++) {
+        SimpleCommand *stage = &command->stages[st];
+        stage->argCount = cursor_count(cur);
+        stage->redirectCount = cursor_count(cur);
+        stage->invalid = cursor_u32(cur);
+        stage->args = arena_alloc(arena, (stage->argCount + 1) * sizeof(char*));
+        for (int a = 0; a < stage->argCount; a++) {
+            stage->args[a] = cursor_string(cur);
+        }
+        stage->args[stage->argCount] = NULL;
+        stage->redirects = arena_alloc(arena, stage->redirectCount * sizeof(Redirect) + 1);
+        for (int r = 0; r < stage->redirectCount; r++) {
+            stage->redirects[r].type = cursor_u32(cur);
+            stage->redirects[r].fd = cursor_u32(cur);
+            stage->redirects[r].target = cursor_string(cur);
+            if (stage->redirects[r].type > REDIRECT_HERE_STRING || stage->redirects[r].fd > REDIRECT_MAX_FD) {
+                cur->ok = false;
+            }
+        }
+    }
+    return cur->ok;
+}
+
+
+
+// Rebuilds the command tree of one line from its compiled form. The arrays come from the arena,
+// the strings point straight into the compiled data
+CommandLine* decode_command_line(Arena *arena, CompiledCursor *cur) {
+    CommandLine *line = arena_alloc(arena, sizeof(CommandLine));
+    line->commandCount = cursor_count(cur);
+    line->background = cursor_u32(cur);
+    line->commands = arena_alloc(arena, line->commandCount * sizeof(Pipeline) + 1);
+
+    for (int c = 0; c < line->commandCount && cur->ok; c++) {
+        Pipeline *command = &line->commands[c];
+        while (decode_pipeline(arena, cur, command) && command->link != LINK_NONE) {
+            command->next = arena_alloc(arena, sizeof(Pipeline)); // Rest of the and-or list
+            command = command->next;
+        }
+    }
+    return cur->ok ? line : NULL;
+}
+
+
+
+// Parses a whole script (one record per line) into `out`
+void compile_script(const char *source, size_t size, ByteBuffer *out) {
+    CompiledHeader header;
+    memset(&header, 0, sizeof(header));
+    bytebuf_put(out, &header, sizeof(header)); // Filled in at the end
+
+    uint32_t lineCount = 0;
+    const char *pos = source;
+    const char *end = source + size;
+    while (pos < end) {
+        const char *newline = memchr(pos, '\n', end - pos);
+        size_t len = newline ? (size_t)(newline - pos) : (size_t)(end - pos);
+
+        serialize_command_line(out, parse_line(&lineArena, pos, len));
+        arena_reset(&lineArena);
+        lineCount++;
+        pos += len + (newline ? 1 : 0);
+    }
+
+    memcpy(header.magic, COMPILE_CACHE_MAGIC, 4);
+    header.version = COMPILE_CACHE_VERSION;
+    header.sourceHash = fnv1a64(source, size);
+    header.sourceSize = size;
+    header.payloadHash = fnv1a64(out->data + sizeof(header), out->len - sizeof(header));
+    header.lineCount = lineCount;
+    memcpy(out->data, &header, sizeof(header));
+}
+
+
+
+// Checks that `data` is a complete compiled form of the script with the given hash and size
+bool compiled_script_valid(const char *data, size_t size, uint64_t sourceHash, uint64_t sourceSize) {
+    CompiledHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    return memcmp(header.magic, COMPILE_CACHE_MAGIC, 4) == 0 &&
+           header.version == COMPILE_CACHE_VERSION &&
+           header.sourceHash == sourceHash &&
+           header.sourceSize == sourceSize &&
+           header.payloadHash == fnv1a64(data + sizeof(header), size - sizeof(header));
+}
+
+
+
+// Executes every line of a compiled script
+void run_compiled_script(const char *data, size_t size) {
+    CompiledHeader header;
+    memcpy(&header, data, sizeof(header));
+    CompiledCursor cur = { data + sizeof(header), data + size, true };
+
+    for (uint32_t i = 0; i < header.lineCount; i++) {
+        CommandLine *line = decode_command_line(&lineArena, &cur);
+        if (line == NULL) {
+            fprintf(stderr, "An error has occurred\n"); // Corrupt file that still passed the hash
+            exit(EXIT_FAILURE);
+        }
+        execute_command_line(line);
+        arena_reset(&lineArena);
+    }
+}
+
+
+
+// Creates the cache dir (`chosen`, or the default one) and its parents if needed, returns its
+// path (malloc'd) or NULL
+char* prepare_cache_dir(const char *chosen) {
+    char dir[PATH_MAX];
+    if (chosen != NULL) {
+        snprintf(dir, sizeof(dir), "%s", chosen);
+    } else if (getenv("XDG_CACHE_HOME") != NULL && getenv("XDG_CACHE_HOME")[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s/wish", getenv("XDG_CACHE_HOME"));
+    } else if (getenv("HOME") != NULL) {
+        snprintf(dir, sizeof(dir), "%s/.cache/wish", getenv("HOME"));
+    } else {
+        return NULL;
+    }
+
+    // mkdir -p
+    for (char *slash = strchr(dir + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash != NULL) *slash = '\0';
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST) return NULL;
+        if (slash == NULL) break;
+        *slash = '/';
+    }
+    return strdup(dir);
+}
+
+
+
+/**            ####     bool run_script_with_compile_cache(const char *scriptPath)    ####
+ * 
+ * Runs a batch script through the compile cache: if a valid compiled form of the current script
+ * contents exists it is mmap'd and executed, otherwise the script is compiled, the result stored
+ * (written to a temp file and renamed, so concurrent runs never see half a file) and executed.
+ * Problems with the cache itself are not fatal, the script still runs from the in-memory copy.
+ * 
+ * Returns:
+ *   false if the script can't be mapped, so the caller falls back to reading it line by line.
+ */
+bool run_script_with_compile_cache(const char *scriptPath) {
+    size_t sourceSize;
+    bool failed;
+    char *source = map_file(scriptPath, &sourceSize, &failed);
+    if (failed) return false;
+    if (sourceSize == 0) return true; // Empty script, nothing to run
+
+    uint64_t sourceHash = fnv1a64(source, sourceSize);
+    char cachePath[PATH_MAX] = "";
+    char *dir = prepare_cache_dir(compile_cache_dir);
+    if (dir != NULL) {
+        snprintf(cachePath, sizeof(cachePath), "%s/%016llx.wishc", dir, (unsigned long long)sourceHash);
+        free(dir);
+    }
+
+    if (cachePath[0] != '\0') {
+        size_t compiledSize;
+        char *compiled = map_file(cachePath, &compiledSize, &failed);
+        if (compiled != NULL && compiled_script_valid(compiled, compiledSize, sourceHash, sourceSize)) {
+            if (debug_mode) printf("Debug: Compile cache hit: %s\n", cachePath);
+            munmap(source, sourceSize);
+            run_compiled_script(compiled, compiledSize);
+            munmap(compiled, compiledSize);
+            return true;
+        }
+        if (compiled != NULL) munmap(compiled, compiledSize);
+    }
+
+    if (debug_mode) printf("Debug: Compile cache miss, compiling %s\n", scriptPath);
+    ByteBuffer out = { NULL, 0, 0 };
+    compile_script(source, sourceSize, &out);
+    munmap(source, sourceSize);
+
+    if (cachePath[0] != '\0') {
+        char tmpPath[PATH_MAX + 32];
+        snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", cachePath, (int)getpid());
+        int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool written = false;
+        if (fd != -1) {
+            written = write(fd, out.data, out.len) == (ssize_t)out.len;
+            close(fd);
+        }
+        if (!written || rename(tmpPath, cachePath) == -1) {
+            unlink(tmpPath); // Not fatal, the next run just compiles again
+        }
+    }
+
+    run_compiled_script(out.data, out.len);
+    free(out.data);
+    return true;
+}
+
+
+////////#########//////// END SCRIPT COMPILE CACHE ////////#########////////
+
+
+
+
+
+
+////////#########//////// INCREMENTAL MODE ////////#########////////
+
+
+// With --incremental a foreground command that writes its stdout to a file with '>' is skipped
+// when the very same run already produced that file. A run is fingerprinted by the program the
+// path lookup found (with its inode, size and mtime), the working directory, the arguments, the
+// redirections and its inputs: every argument naming an existing file or directory, and every
+// '<' file, by size, mtime and (regular files) content hash. The index maps each output file to
+// the fingerprint that made it and how the file looked afterwards, so an output that was changed
+// or removed since is made again. Only runs that exited 0 are remembered.
+// The index is one text line per output in DIR/incremental.idx, read at start, written at exit
+
+#define INCREMENTAL_INDEX "incremental.idx"
+
+
+// What made an output file, and the file as that run left it
+typedef struct {
+    char *output;          // Absolute path of the '>' file, NULL for a free slot
+    uint64_t fingerprint;
+    int64_t size;
+    int64_t mtimeNs;
+} MemoEntry;
+
+typedef struct {
+    MemoEntry *slots;      // Open addressing by hash of the output path
+    int capacity;          // Power of two
+    int count;
+    bool dirty;            // Changed since it was read, rewrite at exit
+    char *indexPath;       // NULL without a usable cache directory
+    int hits, misses;
+    pid_t owner;           // Only the shell writes the index at exit, not its forked children
+} MemoIndex;
+
+MemoIndex memoIndex;
+
+
+
+MemoEntry* memo_slot(MemoEntry *slots, int capacity, const char *output) {
+    size_t mask = capacity - 1;
+    size_t i = fnv1a64(output, strlen(output)) & mask;
+    while (slots[i].output != NULL && strcmp(slots[i].output, output) != 0) i = (i + 1) & mask;
+    return &slots[i];
+}
+
+
+
+// Remembers (or updates) the run behind `output`, which the index takes ownership of
+void memo_put(char *output, uint64_t fingerprint, int64_t size, int64_t mtimeNs) {
+    if ((memoIndex.count + 1) * 2 > memoIndex.capacity) {
+        int capacity = memoIndex.capacity ? memoIndex.capacity * 2 : 64;
+        MemoEntry *slots = calloc(capacity, sizeof(MemoEntry));
+        if (slots == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < memoIndex.capacity; i++) {
+            if (memoIndex.slots[i].output != NULL) {
+                *memo_slot(slots, capacity, memoIndex.slots[i].output) = memoIndex.slots[i];
+            }
+        }
+        free(memoIndex.slots);
+        memoIndex.slots = slots;
+        memoIndex.capacity = capacity;
+    }
+
+    MemoEntry *entry = memo_slot(memoIndex.slots, memoIndex.capacity, output);
+    if (entry->output == NULL) {
+        memoIndex.count++;
+    } else {
+        free(entry->output);
+    }
+    entry->output = output;
+    entry->fingerprint = fingerprint;
+    entry->size = size;
+    entry->mtimeNs = mtimeNs;
+}
+
+
+
+// Writes the index back if it changed and, with --debug, reports how many commands were skipped
+void incremental_finish() {
+    if (getpid() != memoIndex.owner) return;
+
+    if (memoIndex.dirty && memoIndex.indexPath != NULL) {
+        ByteBuffer out = { NULL, 0, 0 };
+        for (int i = 0; i < memoIndex.capacity; i++) {
+            MemoEntry *entry = &memoIndex.slots[i];
+            if (entry->output == NULL) continue;
+            char line[PATH_MAX + 64];
+            int len = snprintf(line, sizeof(line), "%016llx %lld %lld %s\n", (unsigned long long)entry->fingerprint,
+                               (long long)entry->size, (long long)entry->mtimeNs, entry->output);
+            if (len > 0 && (size_t)len < sizeof(line)) bytebuf_put(&out, line, len);
+        }
+
+        char tmpPath[PATH_MAX + 32];
+        snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", memoIndex.indexPath, (int)getpid());
+        int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool written = false;
+        if (fd != -1) {
+            written = out.len == 0 || write_all(fd, out.data, out.len) == 0;
+            close(fd);
+        }
+        if (!written || rename(tmpPath, memoIndex.indexPath) == -1) unlink(tmpPath); // Next run redoes them
+        free(out.data);
+    }
+    if (debug_mode) printf("Debug: Incremental: %d hits, %d misses\n", memoIndex.hits, memoIndex.misses);
+}
+
+
+
+// Reads the index of the cache directory (--incremental[=DIR]), once at start
+void incremental_start() {
+    memoIndex.owner = getpid();
+    atexit(incremental_finish);
+
+    char *dir = prepare_cache_dir(incremental_dir);
+    if (dir == NULL) return; // Still works, only within this run
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" INCREMENTAL_INDEX, dir);
+    free(dir);
+    memoIndex.indexPath = strdup(path);
+
+    size_t size;
+    bool failed;
+    char *data = map_file(path, &size, &failed);
+    if (data == NULL) return;
+    size_t pos = 0;
+    while (pos < size) {
+        const char *line = data + pos;
+        const char *newline = memchr(line, '\n', size - pos);
+        if (newline == NULL) break; // Cut short by a crash, ignore
+        pos = newline - data + 1;
+
+        // "fingerprint size mtime path"
+        char *end;
+        uint64_t fingerprint = strtoull(line, &end, 16);
+        int64_t outputSize = strtoll(end, &end, 10);
+        int64_t mtimeNs = strtoll(end, &end, 10);
+        if (*end != ' ' || end[1] != '/' || end >= newline) continue;
+        end++;
+        memo_put(strndup(end, newline - end), fingerprint, outputSize, mtimeNs);
+    }
+    munmap(data, size);
+}
+
+
+
+// The '>' file of a command whose run can be memoized, or NULL. Appending with '>>' isn't
+// repeatable, so such commands always run
+const char* incremental_output(SimpleCommand *cmd) {
+    const char *output = NULL;
+    for (int i = 0; i < cmd->redirectCount; i++) {
+        if (cmd->redirects[i].type == REDIRECT_APPEND) return NULL;
+        if (cmd->redirects[i].type == REDIRECT_OUT && cmd->redirects[i].fd == STDOUT_FILENO) {
+            output = cmd->redirects[i].target;
+        }
+    }
+    return cmd->invalid ? NULL : output;
+}
+
+
+
+// Adds what identifies the file (or directory) `path` right now, nothing if it doesn't exist
+void fingerprint_file(ByteBuffer *buf, const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) return;
+    int64_t identity[4] = { (int64_t)st.st_dev, (int64_t)st.st_ino, (int64_t)st.st_size,
+                            (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec };
+    bytebuf_put_string(buf, path);
+    bytebuf_put(buf, identity, sizeof(identity));
+    if (!S_ISREG(st.st_mode)) return;
+
+    size_t size;
+    bool failed;
+    char *data = map_file(path, &size, &failed);
+    uint64_t contentHash = data != NULL ? fnv1a64(data, size) : 0;
+    if (data != NULL) munmap(data, size);
+    bytebuf_put(buf, &contentHash, sizeof(contentHash));
+}
+
+
+
+// Absolute form of a (maybe relative) output path, malloc'd. NULL if it doesn't fit
+char* incremental_key(const char *output) {
+    char path[PATH_MAX];
+    if (output[0] == '/') {
+        snprintf(path, sizeof(path), "%s", output);
+    } else {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) return NULL;
+        if (snprintf(path, sizeof(path), "%s/%s", cwd, output) >= (int)sizeof(path)) return NULL;
+    }
+    return strchr(path, '\n') != NULL ? NULL : strdup(path);
+}
+
+
+
+/**            ####     bool incremental_check(SimpleCommand *cmd, const char *output, uint64_t *fingerprint)    ####
+ * 
+ * Decides if `cmd`, which writes `output` with '>', can be skipped. The fingerprint of the run
+ * it is about to do goes to *fingerprint (0 if the program isn't found: such runs aren't
+ * remembered), for incremental_record() once the command succeeded.
+ * 
+ * Returns:
+ *   true if the index says this exact run made `output` and the file is still as it left it.
+ */
+bool incremental_check(SimpleCommand *cmd, const char *output, uint64_t *fingerprint) {
+    *fingerprint = 0;
+    char *executable = findExecutable(cmd->args[0]);
+    if (executable == NULL) return false;
+
+    ByteBuffer buf = { NULL, 0, 0 };
+    char cwd[PATH_MAX];
+    bytebuf_put_string(&buf, getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "");
+    fingerprint_file(&buf, executable);
+    free(executable);
+    bytebuf_put_u32(&buf, cmd->argCount);
+    for (int i = 0; i < cmd->argCount; i++) bytebuf_put_string(&buf, cmd->args[i]);
+    bytebuf_put_u32(&buf, cmd->redirectCount);
+    for (int i = 0; i < cmd->redirectCount; i++) {
+        bytebuf_put_u32(&buf, cmd->redirects[i].type * 16 + cmd->redirects[i].fd);
+        bytebuf_put_string(&buf, cmd->redirects[i].target);
+    }
+
+    // Inputs: files named by the arguments and the '<' files, never the output itself
+    for (int i = 1; i < cmd->argCount; i++) {
+        if (strcmp(cmd->args[i], output) != 0) fingerprint_file(&buf, cmd->args[i]);
+    }
+    for (int i = 0; i < cmd->redirectCount; i++) {
+        if (cmd->redirects[i].type == REDIRECT_IN) fingerprint_file(&buf, cmd->redirects[i].target);
+    }
+    *fingerprint = fnv1a64(buf.data, buf.len) | 1; // Never 0
+    free(buf.data);
+
+    char *key = incremental_key(output);
+    MemoEntry *entry = key != NULL && memoIndex.capacity > 0 ? memo_slot(memoIndex.slots, memoIndex.capacity, key) : NULL;
+    struct stat st;
+    bool hit = entry != NULL && entry->output != NULL && entry->fingerprint == *fingerprint &&
+               stat(key, &st) == 0 && st.st_size == entry->size &&
+               (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec == entry->mtimeNs;
+    if (hit) {
+        memoIndex.hits++;
+        if (debug_mode) printf("Debug: Incremental hit: %s\n", key);
+    } else {
+        memoIndex.misses++;
+    }
+    free(key);
+    return hit;
+}
+
+
+
+// `output` was just made by the run with `fingerprint`, remember it
+void incremental_record(const char *output, uint64_t fingerprint) {
+    char *key = incremental_key(output);
+    struct stat st;
+    if (fingerprint == 0 || key == NULL || stat(key, &st) == -1 || !S_ISREG(st.st_mode)) {
+        free(key); // Not a file we can check later (e.g. /dev/null)
+        return;
+    }
+    memo_put(key, fingerprint, st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec);
+    memoIndex.dirty = true;
+}
+
+
+////////#########//////// END INCREMENTAL MODE ////////#########////////
+
+
+
+
+
+
+
+////////#########//////// LINE EDITOR ////////#########////////
+
+
+// Interactive input on a terminal: a raw mode line editor with history (kept in a ring and
+// appended to a file), incremental reverse search (Ctrl-R) and Tab completion of commands and
+// file names. Without a terminal, or with --no-edit, the shell reads lines like in batch mode
+
+#define HISTORY_MAX 1000   // Lines kept in memory, older ones are dropped from the ring
+#define COMPLETION_LIST_MAX 200 // Candidates shown on a double Tab
+
+
+// One remembered line. `signature` has a bit per (hashed) pair of adjacent characters, so a
+// search only runs memmem() on lines that have every pair of the query
+typedef struct {
+    char *text;
+    size_t len;
+    uint64_t signature;
+} HistoryEntry;
+
+typedef struct {
+    HistoryEntry entries[HISTORY_MAX];
+    int start;   // Oldest entry in the ring
+    int count;
+    int fd;      // History file, opened O_APPEND so every line is one atomic write; -1 if none
+} History;
+
+History history = { .fd = -1 };
+
+
+// Names in one PATH directory, for completing commands. Rescanned only when its mtime changes
+typedef struct {
+    char *dir;
+    struct timespec mtime;
+    bool scanned;
+    char **names;
+    int count;
+    int capacity;
+} CompletionDir;
+
+CompletionDir *completionDirs = NULL;
+int completionDirCount = 0;
+
+
+// State of the line being edited
+typedef struct {
+    char *buf;
+    size_t len, cap;
+    size_t pos;            // Cursor, 0..len
+    const char *prompt;
+    int historyIndex;      // Entry shown (0 = oldest), history.count = the new line
+    char *draft;           // The new line, kept while browsing the history
+    bool lastWasTab;       // A second Tab in a row lists the candidates
+    ByteBuffer out;        // Screen update, written with one write()
+} LineEditor;
+
+struct termios editorCookedTermios; // Terminal settings to give back to commands
+pid_t editorOwner = 0;              // The shell running the editor, not its forked children
+
+
+
+uint64_t history_signature(const char *text, size_t len) {
+    uint64_t signature = 0;
+    for (size_t i = 0; i + 1 < len; i++) {
+        signature |= 1ULL << (((unsigned char)text[i] * 31u + (unsigned char)text[i + 1]) & 63);
+    }
+    return signature;
+}
+
+
+
+HistoryEntry* history_at(int index) {
+    return &history.entries[(history.start + index) % HISTORY_MAX];
+}
+
+
+
+// Remembers a line, and appends it to the history file when `persist` is set. Blank lines and
+// repeats of the previous line are skipped like HISTCONTROL=ignoredups
+void history_add(const char *text, size_t len, bool persist) {
+    size_t blank = 0;
+    while (blank < len && isspace((unsigned char)text[blank])) blank++;
+    if (blank == len) return;
+    if (history.count > 0) {
+        HistoryEntry *last = history_at(history.count - 1);
+        if (last->len == len && memcmp(last->text, text, len) == 0) return;
+    }
+
+    if (history.count == HISTORY_MAX) {
+        free(history_at(0)->text);
+        history.start = (history.start + 1) % HISTORY_MAX;
+        history.count--;
+    }
+    HistoryEntry *entry = history_at(history.count++);
+    entry->text = strndup(text, len);
+    if (entry->text == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    entry->len = len;
+    entry->signature = history_signature(text, len);
+
+    if (persist && history.fd != -1) {
+        struct iovec parts[2] = { { (void *)text, len }, { "\n", 1 } };
+        if (writev(history.fd, parts, 2) != (ssize_t)len + 1) { // One write, so shells don't interleave
+            close(history.fd); // Disk full or similar: keep the history in memory only
+            history.fd = -1;
+        }
+    }
+}
+
+
+
+// Loads the last HISTORY_MAX lines of the history file and keeps it open for appending
+void history_open(const char *path) {
+    size_t size;
+    bool failed;
+    char *data = map_file(path, &size, &failed);
+    if (data != NULL) {
+        size_t pos = 0;
+        while (pos < size) {
+            const char *newline = memchr(data + pos, '\n', size - pos);
+            size_t len = newline ? (size_t)(newline - (data + pos)) : size - pos;
+            history_add(data + pos, len, false);
+            pos += len + 1;
+        }
+        munmap(data, size);
+    }
+    history.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+
+
+// Newest line at or before `from` containing `query`, or -1
+int history_search(const char *query, size_t len, int from) {
+    uint64_t signature = history_signature(query, len);
+    for (int i = from; i >= 0; i--) {
+        HistoryEntry *entry = history_at(i);
+        if ((entry->signature & signature) == signature && memmem(entry->text, entry->len, query, len) != NULL) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+
+// Brings the directory list in line with globalPathList and rescans the directories whose
+// mtime changed (a program was installed or removed) since the last Tab
+void completion_refresh() {
+    for (int i = globalPathList.count; i < completionDirCount; i++) {
+        for (int n = 0; n < completionDirs[i].count; n++) free(completionDirs[i].names[n]);
+        free(completionDirs[i].names);
+        free(completionDirs[i].dir);
+    }
+    if (globalPathList.count != completionDirCount) {
+        completionDirs = realloc(completionDirs, (globalPathList.count + 1) * sizeof(CompletionDir));
+        if (completionDirs == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = completionDirCount; i < globalPathList.count; i++) {
+            memset(&completionDirs[i], 0, sizeof(CompletionDir));
+        }
+        completionDirCount = globalPathList.count;
+    }
+
+    for (int i = 0; i < completionDirCount; i++) {
+        CompletionDir *entry = &completionDirs[i];
+        if (entry->dir == NULL || strcmp(entry->dir, globalPathList.paths[i]) != 0) {
+            free(entry->dir);
+            entry->dir = strdup(globalPathList.paths[i]);
+            entry->scanned = false;
+        }
+        struct stat st;
+        if (stat(entry->dir, &st) == -1) continue;
+        if (entry->scanned && st.st_mtim.tv_sec == entry->mtime.tv_sec &&
+            st.st_mtim.tv_nsec == entry->mtime.tv_nsec) {
+            continue; // Nothing added or removed
+        }
+
+        for (int n = 0; n < entry->count; n++) free(entry->names[n]);
+        entry->count = 0;
+        entry->mtime = st.st_mtim;
+        entry->scanned = true;
+        DIR *dir = opendir(entry->dir);
+        if (dir == NULL) continue;
+        struct dirent *file;
+        while ((file = readdir(dir)) != NULL) {
+            if (file->d_name[0] == '.') continue;
+            if (faccessat(dirfd(dir), file->d_name, X_OK, 0) != 0) continue;
+            if (entry->count == entry->capacity) {
+                entry->capacity = entry->capacity ? entry->capacity * 2 : 64;
+                entry->names = realloc(entry->names, entry->capacity * sizeof(char*));
+                if (entry->names == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            entry->names[entry->count++] = strdup(file->d_name);
+        }
+        closedir(dir);
+    }
+}
+
+
+
+// Candidates for the word being completed, owned by the list
+typedef struct {
+    char **items;
+    int count;
+    int capacity;
+} CompletionList;
+
+
+
+void completion_add(CompletionList *list, const char *first, const char *second) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 32;
+        list->items = realloc(list->items, list->capacity * sizeof(char*));
+        if (list->items == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t firstLen = strlen(first), secondLen = strlen(second);
+    char *item = malloc(firstLen + secondLen + 1);
+    if (item == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(item, first, firstLen);
+    memcpy(item + firstLen, second, secondLen + 1);
+    list->items[list->count++] = item;
+}
+
+
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+
+// Commands starting with `prefix`: builtins and the programs of every path directory
+void complete_command(CompletionList *list, const char *prefix, size_t len) {
+    for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+        if (strncmp(builtins[i].name, prefix, len) == 0) completion_add(list, builtins[i].name, "");
+    }
+    completion_refresh();
+    for (int d = 0; d < completionDirCount; d++) {
+        for (int n = 0; n < completionDirs[d].count; n++) {
+            if (strncmp(completionDirs[d].names[n], prefix, len) == 0) {
+                completion_add(list, completionDirs[d].names[n], "");
+            }
+        }
+    }
+}
+
+
+
+// Files matching `word` (maybe with a directory part), directories get a trailing '/'
+void complete_file(CompletionList *list, const char *word, size_t len) {
+    const char *slash = memrchr(word, '/', len);
+    char dirPart[PATH_MAX];
+    size_t dirLen = slash ? (size_t)(slash - word + 1) : 0;
+    if (dirLen >= sizeof(dirPart)) return;
+    memcpy(dirPart, word, dirLen);
+    dirPart[dirLen] = '\0';
+    const char *prefix = word + dirLen;
+    size_t prefixLen = len - dirLen;
+
+    DIR *dir = opendir(dirLen > 0 ? dirPart : ".");
+    if (dir == NULL) return;
+    struct dirent *file;
+    while ((file = readdir(dir)) != NULL) {
+        if (strncmp(file->d_name, prefix, prefixLen) != 0) continue;
+        if (file->d_name[0] == '.' && (prefixLen == 0 || strcmp(file->d_name, ".") == 0 ||
+                                       strcmp(file->d_name, "..") == 0)) {
+            continue; // Hidden files only when asked for
+        }
+        bool isDir = file->d_type == DT_DIR;
+        if (file->d_type == DT_UNKNOWN || file->d_type == DT_LNK) {
+            struct stat st;
+            isDir = fstatat(dirfd(dir), file->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        char name[NAME_MAX + 2];
+        snprintf(name, sizeof(name), "%s%s", file->d_name, isDir ? "/" : "");
+        completion_add(list, dirPart, name);
+    }
+    closedir(dir);
+}
+
+
+
+void editor_append(LineEditor *ed, const char *text, size_t len) {
+    bytebuf_put(&ed->out, text, len);
+}
+
+
+
+int editor_columns() {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1 || size.ws_col == 0) return 80;
+    return size.ws_col;
+}
+
+
+
+// Redraws prompt and line in place. Lines wider than the terminal scroll sideways so the
+// cursor stays visible
+void editor_show(LineEditor *ed, const char *prompt, const char *text, size_t len, size_t pos) {
+    size_t promptLen = strlen(prompt);
+    size_t columns = editor_columns();
+    while (promptLen + pos >= columns && pos > 0) {
+        text++;
+        len--;
+        pos--;
+    }
+    if (promptLen + len > columns) len = columns > promptLen ? columns - promptLen : 0;
+
+    char move[32];
+    ed->out.len = 0;
+    editor_append(ed, "\r", 1);
+    editor_append(ed, prompt, promptLen);
+    editor_append(ed, text, len);
+    editor_append(ed, "\x1b[0K", 4); // Erase whatever the old line left on the right
+    editor_append(ed, move, snprintf(move, sizeof(move), "\r\x1b[%zuC", promptLen + pos));
+    write_all(STDOUT_FILENO, ed->out.data, ed->out.len);
+}
+
+
+
+void editor_refresh(LineEditor *ed) {
+    editor_show(ed, ed->prompt, ed->buf, ed->len, ed->pos);
+}
+
+
+
+// Replaces the text between `from` and `to` with `text`, the cursor ends after it
+void editor_replace(LineEditor *ed, size_t from, size_t to, const char *text, size_t len) {
+    size_t newLen = ed->len - (to - from) + len;
+    if (newLen + 1 > ed->cap) {
+        ed->cap = (newLen + 1) * 2;
+        ed->buf = realloc(ed->buf, ed->cap);
+        if (ed->buf == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memmove(ed->buf + from + len, ed->buf + to, ed->len - to);
+    memcpy(ed->buf + from, text, len);
+    ed->len = newLen;
+    ed->buf[ed->len] = '\0';
+    ed->pos = from + len;
+}
+
+
+
+void editor_set(LineEditor *ed, const char *text, size_t len) {
+    editor_replace(ed, 0, ed->len, text, len);
+}
+
+
+
+// Up/Down: shows the entry `index`, the draft of the new line when it is history.count
+void editor_history_move(LineEditor *ed, int index) {
+    if (index < 0 || index > history.count || index == ed->historyIndex) return;
+    if (ed->historyIndex == history.count) {
+        free(ed->draft);
+        ed->draft = strndup(ed->buf, ed->len);
+    }
+    ed->historyIndex = index;
+    if (index == history.count) {
+        editor_set(ed, ed->draft ? ed->draft : "", ed->draft ? strlen(ed->draft) : 0);
+    } else {
+        editor_set(ed, history_at(index)->text, history_at(index)->len);
+    }
+    editor_refresh(ed);
+}
+
+
+
+// Tab: completes the word left of the cursor as a command (first word of a command) or a file
+void editor_complete(LineEditor *ed) {
+    size_t start = ed->pos;
+    while (start > 0 && !isspace((unsigned char)ed->buf[start - 1]) && !strchr("&|<>", ed->buf[start - 1])) start--;
+    size_t before = start;
+    while (before > 0 && isspace((unsigned char)ed->buf[before - 1])) before--;
+    bool commandWord = (before == 0 || strchr("&|", ed->buf[before - 1]) != NULL) &&
+                       memchr(ed->buf + start, '/', ed->pos - start) == NULL;
+
+    CompletionList list = { NULL, 0, 0 };
+    if (commandWord) {
+        complete_command(&list, ed->buf + start, ed->pos - start);
+    } else {
+        char *word = strndup(ed->buf + start, ed->pos - start);
+        complete_file(&list, word, ed->pos - start);
+        free(word);
+    }
+    qsort(list.items, list.count, sizeof(char*), compare_strings);
+    int unique = 0; // Same program in two path directories is one candidate
+    for (int i = 0; i < list.count; i++) {
+        if (unique > 0 && strcmp(list.items[unique - 1], list.items[i]) == 0) {
+            free(list.items[i]);
+        } else {
+            list.items[unique++] = list.items[i];
+        }
+    }
+    list.count = unique;
+
+    if (list.count == 0) {
+        write_all(STDOUT_FILENO, "\a", 1);
+    } else if (list.count == 1) {
+        const char *item = list.items[0];
+        size_t len = strlen(item);
+        editor_replace(ed, start, ed->pos, item, len);
+        if (item[len - 1] != '/') editor_replace(ed, ed->pos, ed->pos, " ", 1);
+        editor_refresh(ed);
+    } else {
+        // Longest common prefix of the (sorted) candidates: first and last are enough
+        size_t common = 0;
+        const char *first = list.items[0], *last = list.items[list.count - 1];
+        while (first[common] != '\0' && first[common] == last[common]) common++;
+        if (common > ed->pos - start) {
+            editor_replace(ed, start, ed->pos, first, common);
+            editor_refresh(ed);
+        } else if (ed->lastWasTab) {
+            ed->out.len = 0;
+            editor_append(ed, "\r\n", 2);
+            for (int i = 0; i < list.count && i < COMPLETION_LIST_MAX; i++) {
+                editor_append(ed, list.items[i], strlen(list.items[i]));
+                editor_append(ed, i == list.count - 1 ? "\r\n" : "  ", 2);
+            }
+            if (list.count > COMPLETION_LIST_MAX) editor_append(ed, "...\r\n", 5);
+            write_all(STDOUT_FILENO, ed->out.data, ed->out.len);
+            editor_refresh(ed);
+        } else {
+            write_all(STDOUT_FILENO, "\a", 1);
+        }
+    }
+    for (int i = 0; i < list.count; i++) free(list.items[i]);
+    free(list.items);
+}
+
+
+
+// Reads one key. Escape sequences of the arrows, Home, End and Delete come back as the
+// Ctrl keys doing the same. Returns -1 at the end of the input
+int editor_read_key() {
+    unsigned char c;
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, &c, 1)) == -1 && errno == EINTR) {}
+    if (n <= 0) return -1;
+    if (c != 0x1b) return c;
+
+    unsigned char seq[3];
+    if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1) return 0x1b;
+    if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9') {
+        if (read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~') return 0x1b;
+        switch (seq[1]) {
+            case '1': case '7': return 0x01; // Home
+            case '4': case '8': return 0x05; // End
+            case '3': return 0x7f00;         // Delete
+        }
+        return 0x1b;
+    }
+    if (seq[0] == '[' || seq[0] == 'O') {
+        switch (seq[1]) {
+            case 'A': return 0x10; // Up: Ctrl-P
+            case 'B': return 0x0e; // Down: Ctrl-N
+            case 'C': return 0x06; // Right: Ctrl-F
+            case 'D': return 0x02; // Left: Ctrl-B
+            case 'H': return 0x01;
+            case 'F': return 0x05;
+        }
+    }
+    return 0x1b;
+}
+
+
+
+// Ctrl-R: incremental reverse search. Typing narrows the query, Ctrl-R goes to older matches,
+// Enter runs the match, Ctrl-G/Ctrl-C gives the original line back and any other key keeps the
+// match for editing. A key that makes the query stop matching keeps the last match on screen
+// (and for Enter), like readline. Returns the key that ended the search, for the caller to handle
+int editor_search(LineEditor *ed) {
+    char query[256];
+    size_t queryLen = 0;
+    size_t matchLen = 0; // Length of the query the match was found with
+    int match = history.count - 1;
+    bool found = true;
+
+    for (;;) {
+        char prompt[300];
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ", found ? "" : "failing ",
+                 (int)queryLen, query);
+        const char *text = "";
+        size_t len = 0, pos = 0;
+        if (match >= 0 && matchLen > 0) {
+            HistoryEntry *entry = history_at(match);
+            text = entry->text;
+            len = entry->len;
+            const char *at = memmem(text, len, query, matchLen);
+            pos = at != NULL ? (size_t)(at - text) : len;
+        }
+        editor_show(ed, prompt, text, len, pos);
+
+        int key = editor_read_key();
+        if (key == 0x12) { // Ctrl-R: next older match
+            int older = match > 0 ? history_search(query, queryLen, match - 1) : -1;
+            found = older >= 0;
+            if (found) {
+                match = older;
+                matchLen = queryLen;
+            }
+            continue;
+        }
+        if ((key == 0x7f || key == 0x08) && queryLen > 0) {
+            queryLen--;
+            int newest = history_search(query, queryLen, history.count - 1);
+            found = newest >= 0;
+            if (found) {
+                match = newest;
+                matchLen = queryLen;
+            }
+            continue;
+        }
+        if (key >= 0x20 && key < 0x7f && queryLen < sizeof(query)) {
+            query[queryLen++] = (char)key;
+            int next = found ? history_search(query, queryLen, match >= 0 ? match : history.count - 1) : -1;
+            found = next >= 0;
+            if (found) {
+                match = next;
+                matchLen = queryLen;
+            }
+            continue;
+        }
+
+        if (key == 0x07 || key == 0x03 || key == -1) { // Ctrl-G, Ctrl-C: back to the old line
+            editor_refresh(ed);
+            return key == -1 ? -1 : 0;
+        }
+        if (match >= 0 && matchLen > 0) {
+            editor_set(ed, history_at(match)->text, history_at(match)->len);
+            ed->historyIndex = match;
+        }
+        editor_refresh(ed);
+        return key;
+    }
+}
+
+
+
+/**            ####     bool editor_read_line(LineEditor *ed, const char **line, size_t *len)    ####
+ * 
+ * Reads one line from the terminal in raw mode. Besides plain typing it knows the usual emacs
+ * keys: Ctrl-A/E (or Home/End), Ctrl-B/F (or arrows) to move, Backspace/Delete/Ctrl-D to
+ * delete, Ctrl-K/U/W to kill to the end, to the start or the word before the cursor, Ctrl-P/N
+ * (or Up/Down) for the history, Ctrl-R to search it, Tab to complete, Ctrl-L to clear the
+ * screen and Ctrl-C to drop the line.
+ * 
+ * The terminal goes back to the settings we found before returning, so the commands of the
+ * line run in a normal (cooked) terminal.
+ * 
+ * Returns:
+ *   false at the end of the input (Ctrl-D on an empty line), true with the line otherwise.
+ */
+bool editor_read_line(LineEditor *ed, const char **line, size_t *len) {
+    struct termios raw = editorCookedTermios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); // Ctrl-C is a key here, not SIGINT
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    fflush(stdout);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    editor_set(ed, "", 0);
+    ed->historyIndex = history.count;
+    ed->lastWasTab = false;
+    editor_refresh(ed);
+
+    bool done = false, eof = false;
+    while (!done) {
+        int key = editor_read_key();
+        bool tab = false;
+        if (key == 0x12) key = editor_search(ed); // Ctrl-R, may hand back the key that ended it
+
+        switch (key) {
+            case -1:
+                eof = true;
+                done = true;
+                break;
+            case '\r': case '\n':
+                done = true;
+                break;
+            case 0x04: // Ctrl-D: end of input on an empty line, delete otherwise
+                if (ed->len == 0) {
+                    eof = true;
+                    done = true;
+                    break;
+                }
+                // fallthrough
+            case 0x7f00: // Delete
+                if (ed->pos < ed->len) editor_replace(ed, ed->pos, ed->pos + 1, "", 0);
+                editor_refresh(ed);
+                break;
+            case 0x7f: case 0x08: // Backspace
+                if (ed->pos > 0) editor_replace(ed, ed->pos - 1, ed->pos, "", 0);
+                editor_refresh(ed);
+                break;
+            case 0x01: ed->pos = 0; editor_refresh(ed); break;
+            case 0x05: ed->pos = ed->len; editor_refresh(ed); break;
+            case 0x02: if (ed->pos > 0) ed->pos--; editor_refresh(ed); break;
+            case 0x06: if (ed->pos < ed->len) ed->pos++; editor_refresh(ed); break;
+            case 0x0b: editor_replace(ed, ed->pos, ed->len, "", 0); editor_refresh(ed); break;
+            case 0x15: editor_replace(ed, 0, ed->pos, "", 0); editor_refresh(ed); break;
+            case 0x17: { // Ctrl-W
+                size_t start = ed->pos;
+                while (start > 0 && ed->buf[start - 1] == ' ') start--;
+                while (start > 0 && ed->buf[start - 1] != ' ') start--;
+                editor_replace(ed, start, ed->pos, "", 0);
+                editor_refresh(ed);
+                break;
+            }
+            case 0x10: editor_history_move(ed, ed->historyIndex - 1); break;
+            case 0x0e: editor_history_move(ed, ed->historyIndex + 1); break;
+            case 0x0c: // Ctrl-L
+                write_all(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+                editor_refresh(ed);
+                break;
+            case 0x03: // Ctrl-C: drop the line, new prompt
+                write_all(STDOUT_FILENO, "^C\r\n", 4);
+                editor_set(ed, "", 0);
+                ed->historyIndex = history.count;
+                last_status = 130;
+                editor_refresh(ed);
+                break;
+            case '\t':
+                editor_complete(ed);
+                tab = true;
+                break;
+            default:
+                if (key >= 0x20 && key < 0x100 && key != 0x7f) {
+                    char c = (char)key;
+                    editor_replace(ed, ed->pos, ed->pos, &c, 1);
+                    editor_refresh(ed);
+                }
+        }
+        ed->lastWasTab = tab;
+    }
+
+    write_all(STDOUT_FILENO, "\r\n", 2);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editorCookedTermios);
+    if (eof) return false;
+    history_add(ed->buf, ed->len, true);
+    *line = ed->buf;
+    *len = ed->len;
+    return true;
+}
+
+
+
+// Gives the terminal back in its original mode if the shell exits from the middle of a line
+void editor_restore_terminal() {
+    // Forked builtin children exit() too; a TCSAFLUSH from them would drop what was typed ahead
+    if (getpid() != editorOwner) return;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editorCookedTermios);
+}
+
+
+
+// True if stdin and stdout are a terminal the editor can drive
+bool editor_usable() {
+    const char *term = getenv("TERM");
+    return isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) &&
+           (term == NULL || strcmp(term, "dumb") != 0) && tcgetattr(STDIN_FILENO, &editorCookedTermios) == 0;
+}
+
+
+
+// Interactive loop with the line editor. `historyPath` NULL means no history file
+void run_line_editor(const char *historyPath) {
+    if (historyPath != NULL) history_open(historyPath);
+    editorOwner = getpid();
+    atexit(editor_restore_terminal);
+
+    LineEditor ed;
+    memset(&ed, 0, sizeof(ed));
+    ed.prompt = "wish> ";
+    const char *line;
+    size_t len;
+    while (editor_read_line(&ed, &line, &len)) {
+        process_command(line, len);
+    }
+    free(ed.buf);
+    free(ed.draft);
+    free(ed.out.data);
+}
+
+
+////////#########//////// END LINE EDITOR ////////#########////////
+
+
+
+
+
+
+////////#########//////// BACKGROUND JOBS ////////#########////////
+
+
+#define JOB_EVENT_BATCH 16 // pidfd events handled per epoll_wait() call
+#define JOB_POLL_MS 10     // Reap interval for children we couldn't get a pidfd for
+
+
+struct Job;
+
+// One process of a background job
+typedef struct {
+    pid_t pid;
+    int pidfd;        // Registered in jobEpollFd, -1 once reaped or when pidfd_open() failed
+    bool done;
+    struct Job *job;  // Job it belongs to
+} JobChild;
+
+
+// A line ended with '&' (--background): all of its commands, running while the shell moves on
+typedef struct Job {
+    int id;              // Number shown by `jobs` and taken by `wait`
+    char *text;          // The command line, as `jobs` shows it
+    JobChild *children;
+    int childCount;
+    int running;         // Children not reaped yet
+    int status;          // Exit status of the last child reaped
+} Job;
+
+
+typedef struct {
+    Job **jobs;
+    int count;
+    int capacity;
+    int nextId;
+} JobTable;
+
+
+JobTable jobTable = { NULL, 0, 0, 1 };
+int jobEpollFd = -1;  // Every live pidfd, so one epoll_wait() covers all background children
+pid_t jobOwner = 0;   // The shell; forked builtin children must not wait on its jobs
+
+
+
+// Rebuilds the text of a parsed line for `jobs`, works for compiled scripts as well
+char* job_describe(CommandLine *line) {
+    ByteBuffer text = { NULL, 0, 0 };
+    for (int c = 0; c < line->commandCount; c++) {
+        for (Pipeline *command = &line->commands[c]; command != NULL; command = command->next) {
+            for (int st = 0; st < command->stageCount; st++) {
+                SimpleCommand *stage = &command->stages[st];
+                for (int a = 0; a < stage->argCount; a++) {
+                    if (a > 0) bytebuf_put(&text, " ", 1);
+                    bytebuf_put(&text, stage->args[a], strlen(stage->args[a]));
+                }
+                for (int r = 0; r < stage->redirectCount; r++) {
+                    const Redirect *redirect = &stage->redirects[r];
+                    static const char *operators[] = { ">", ">>", "<", ">&", "<<<" };
+                    int defaultFd = redirect->type == REDIRECT_IN || redirect->type == REDIRECT_HERE_STRING ? 0 : 1;
+                    char op[16];
+                    int opLen = redirect->fd == defaultFd
+                        ? snprintf(op, sizeof(op), " %s", operators[redirect->type])
+                        : snprintf(op, sizeof(op), " %d%s", redirect->fd, operators[redirect->type]);
+                    bytebuf_put(&text, op, opLen);
+                    if (redirect->type != REDIRECT_DUP) bytebuf_put(&text, " ", 1);
+                    bytebuf_put(&text, redirect->target, strlen(redirect->target));
+                }
+                if (st < command->stageCount - 1) bytebuf_put(&text, " | ", 3);
+            }
+            if (command->link == LINK_AND) bytebuf_put(&text, " && ", 4);
+            if (command->link == LINK_OR) bytebuf_put(&text, " || ", 4);
+        }
+        bytebuf_put(&text, c < line->commandCount - 1 ? " & " : " &", c < line->commandCount - 1 ? 3 : 2);
+    }
+    bytebuf_put(&text, "", 1); // NUL terminator
+    return text.data;
+}
+
+
+
+// Marks a background child as reaped with the given waitpid() status
+void job_child_finished(JobChild *child, int status) {
+    if (child->done) return;
+    child->done = true;
+    if (child->pidfd != -1) {
+        // Explicit DEL: forked builtin children may still hold a copy of the pidfd
+        epoll_ctl(jobEpollFd, EPOLL_CTL_DEL, child->pidfd, NULL);
+        close(child->pidfd);
+        child->pidfd = -1;
+    }
+    child->job->running--;
+    child->job->status = exit_code(status);
+}
+
+
+
+// Called by the parallel scheduler when its waitpid(-1) collected a background child.
+// Returns true if `pid` belonged to a job
+bool job_child_exited(pid_t pid, int status) {
+    for (int j = 0; j < jobTable.count; j++) {
+        Job *job = jobTable.jobs[j];
+        for (int c = 0; c < job->childCount; c++) {
+            if (job->children[c].pid == pid) {
+                job_child_finished(&job->children[c], status);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+
+// Collects background children that exited. Waits up to `timeoutMs` (-1 forever) for the
+// first one. Returns the number reaped
+int jobs_reap(int timeoutMs) {
+    int reaped = 0;
+    bool polling = false; // Children without a pidfd have to be polled
+
+    for (int j = 0; j < jobTable.count; j++) {
+        Job *job = jobTable.jobs[j];
+        for (int c = 0; c < job->childCount; c++) {
+            JobChild *child = &job->children[c];
+            if (child->done || child->pidfd != -1) continue;
+            int status = 0;
+            pid_t result = wait_child(child->pid, &status, WNOHANG);
+            if (result == child->pid || (result == -1 && errno == ECHILD)) {
+                job_child_finished(child, status);
+                reaped++;
+            } else {
+                polling = true;
+            }
+        }
+    }
+    if (reaped > 0 || jobEpollFd == -1) return reaped;
+    if (polling && (timeoutMs < 0 || timeoutMs > JOB_POLL_MS)) timeoutMs = JOB_POLL_MS;
+
+    struct epoll_event events[JOB_EVENT_BATCH];
+    int ready = epoll_wait(jobEpollFd, events, JOB_EVENT_BATCH, timeoutMs);
+    for (int e = 0; e < ready; e++) {
+        JobChild *child = events[e].data.ptr;
+        int status = 0;
+        pid_t result = wait_child(child->pid, &status, WNOHANG);
+        if (result == child->pid || (result == -1 && errno == ECHILD)) {
+            job_child_finished(child, status);
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+
+
+// Removes a job from the table and frees it
+void job_remove(int index) {
+    Job *job = jobTable.jobs[index];
+    for (int c = 0; c < job->childCount; c++) {
+        if (job->children[c].pidfd != -1) {
+            epoll_ctl(jobEpollFd, EPOLL_CTL_DEL, job->children[c].pidfd, NULL);
+            close(job->children[c].pidfd);
+        }
+    }
+    free(job->children);
+    free(job->text);
+    free(job);
+    jobTable.jobs[index] = jobTable.jobs[--jobTable.count];
+}
+
+
+
+/**            ####     void job_start(CommandLine *line)    ####
+ * 
+ * Runs a line that ended with '&' as a background job (--background): every command is
+ * started like in execute_commands_in_parallel(), but instead of waiting the shell records the
+ * children in the job table and returns to read the next line.
+ * 
+ * Each child gets a pidfd (pidfd_open) registered in one epoll set, so `wait`, `exit` and the
+ * end of the input block in a single epoll_wait() for whichever background child exits first,
+ * and the line loop can check for finished jobs with a non-blocking call. Kernels without
+ * pidfd_open fall back to polling those children with waitpid(WNOHANG).
+ */
+void job_start(CommandLine *line) {
+    int total = 0;
+    for (int c = 0; c < line->commandCount; c++) total += line->commands[c].stageCount;
+
+    Job *job = calloc(1, sizeof(Job));
+    pid_t *pids = malloc(total * sizeof(pid_t));
+    if (job == NULL || pids == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int started = 0;
+    for (int c = 0; c < line->commandCount; c++) {
+        started += start_parallel_command(&line->commands[c], pids + started, -1);
+    }
+    if (started == 0) { // Every command failed to start, errors were already printed
+        free(job);
+        free(pids);
+        return;
+    }
+
+    if (jobEpollFd == -1) {
+        jobEpollFd = epoll_create1(EPOLL_CLOEXEC);
+        jobOwner = getpid();
+    }
+    job->children = calloc(started, sizeof(JobChild));
+    if (job->children == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < started; k++) {
+        JobChild *child = &job->children[k];
+        child->pid = pids[k];
+        child->job = job;
+        child->pidfd = jobEpollFd == -1 ? -1 : (int)syscall(SYS_pidfd_open, pids[k], 0);
+        if (child->pidfd != -1) {
+            struct epoll_event event = { .events = EPOLLIN, .data.ptr = child };
+            if (epoll_ctl(jobEpollFd, EPOLL_CTL_ADD, child->pidfd, &event) == -1) {
+                close(child->pidfd);
+                child->pidfd = -1; // Polled instead
+            }
+        }
+    }
+    free(pids);
+    job->childCount = job->running = started;
+    job->id = jobTable.nextId++;
+    job->text = job_describe(line);
+
+    if (jobTable.count == jobTable.capacity) {
+        jobTable.capacity = jobTable.capacity ? jobTable.capacity * 2 : 8;
+        jobTable.jobs = realloc(jobTable.jobs, jobTable.capacity * sizeof(Job*));
+        if (jobTable.jobs == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    jobTable.jobs[jobTable.count++] = job;
+    if (debug_mode) printf("Debug: Started job %d with %d processes\n", job->id, started);
+}
+
+
+
+// `jobs`: lists every job, finished ones are reported once and then forgotten
+void jobs_print() {
+    jobs_reap(0);
+    for (int j = 0; j < jobTable.count; j++) {
+        Job *job = jobTable.jobs[j];
+        if (job->running > 0) {
+            printf("[%d] Running\t%s\n", job->id, job->text);
+        } else {
+            printf("[%d] Done(%d)\t%s\n", job->id, job->status, job->text);
+        }
+    }
+    for (int j = jobTable.count - 1; j >= 0; j--) {
+        if (jobTable.jobs[j]->running == 0) job_remove(j);
+    }
+}
+
+
+
+// `wait ID`: blocks until the job finishes. Returns false if there's no such job
+bool jobs_wait_one(int id) {
+    for (int j = 0; j < jobTable.count; j++) {
+        Job *job = jobTable.jobs[j];
+        if (job->id != id) continue;
+        while (job->running > 0) jobs_reap(-1);
+        job_remove(j);
+        return true;
+    }
+    return false;
+}
+
+
+
+// `wait`, `exit` and end of input: blocks until every background job finished
+void jobs_wait_all() {
+    if (jobTable.count == 0 || getpid() != jobOwner) return;
+    for (int j = 0; j < jobTable.count; j++) {
+        while (jobTable.jobs[j]->running > 0) jobs_reap(-1);
+    }
+    while (jobTable.count > 0) job_remove(jobTable.count - 1);
+}
+
+
+////////#########//////// END BACKGROUND JOBS ////////#########////////
+
+
+
+
+
+////////#########//////// PARALLEL SCRIPT ////////#########////////
+
+
+// Where a script line is in --parallel-script
+typedef enum {
+    LINE_PENDING,  // Waiting for its dependencies
+    LINE_RUNNING,  // Its sub-shell is running
+    LINE_DONE      // Finished, output not necessarily written yet
+} ScriptLineState;
+
+
+// One line of a script run with --parallel-script
+typedef struct {
+    CommandLine *parsed;
+    bool barrier;         // Runs a builtin: waits for every earlier line, every later line waits for it
+    int *deps;            // Earlier lines that have to finish first
+    int depCount;
+    int depCapacity;
+    ScriptLineState state;
+    pid_t pid;            // Sub-shell running the line
+    int status;           // Exit status once done, what "$?" in a later line sees
+    int outFd;            // memfd holding its stdout until its turn comes, -1 if none
+    int errFd;            // Same for stderr
+} ScriptLine;
+
+
+
+#define FILE_USE_BUCKETS 1024 // Hash buckets of the file index, a power of two
+
+
+// What the lines since the last barrier did with one file name
+typedef struct FileUse {
+    const char *name;
+    int writer;           // Last line with a '>' to it, -1 if none
+    int *readers;         // Lines naming it since that write
+    int readerCount;
+    int readerCapacity;
+    struct FileUse *next; // Next entry in the same bucket
+} FileUse;
+
+
+
+// Appends `value` to a growable int array
+void int_list_push(int **items, int *count, int *capacity, int value) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 8;
+        *items = realloc(*items, *capacity * sizeof(int));
+        if (*items == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*items)[(*count)++] = value;
+}
+
+
+
+// Finds the entry of `name` in the file index, creating it (in `arena`) if needed
+FileUse* file_use_get(FileUse **buckets, Arena *arena, const char *name) {
+    unsigned int slot = hashCommandName(name) & (FILE_USE_BUCKETS - 1);
+    for (FileUse *use = buckets[slot]; use != NULL; use = use->next) {
+        if (strcmp(use->name, name) == 0) return use;
+    }
+    FileUse *use = arena_alloc(arena, sizeof(FileUse));
+    memset(use, 0, sizeof(*use));
+    use->name = name;
+    use->writer = -1;
+    use->next = buckets[slot];
+    buckets[slot] = use;
+    return use;
+}
+
+
+
+// Forgets every file in the index, at a barrier nothing earlier matters any more
+void file_use_clear(FileUse **buckets) {
+    for (int i = 0; i < FILE_USE_BUCKETS; i++) {
+        for (FileUse *use = buckets[i]; use != NULL; use = use->next) free(use->readers);
+        buckets[i] = NULL;
+    }
+}
+
+
+
+// True if the line runs a shell builtin anywhere, or reads "$?". Those change (or read) the
+// shell itself
+bool line_is_barrier(CommandLine *line) {
+    for (int c = 0; c < line->commandCount; c++) {
+        for (Pipeline *command = &line->commands[c]; command != NULL; command = command->next) {
+            if (command->usesStatus || command->usesGlob) return true; // Reads unknown files
+            for (int st = 0; st < command->stageCount; st++) {
+                if (is_shell_builtin(&command->stages[st])) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+
+
+// A line naming (or reading with '<') a file: waits for its last writer, then counts as a reader
+void script_line_read(ScriptLine *line, int index, FileUse *use, int pass) {
+    if (pass == 0 && use->writer >= 0) {
+        int_list_push(&line->deps, &line->depCount, &line->depCapacity, use->writer);
+    } else if (pass == 1 && (use->readerCount == 0 || use->readers[use->readerCount - 1] != index)) {
+        int_list_push(&use->readers, &use->readerCount, &use->readerCapacity, index);
+    }
+}
+
+
+
+// Finds the earlier lines `lines[index]` depends on. A line naming a file waits for its last
+// writer; a line writing ('>') a file also waits for everyone that named it since. Files are
+// matched by the words as written, commands that reach files some other way (a directory
+// listing, a script opening them) aren't seen
+void script_line_link(ScriptLine *lines, int index, int lastBarrier, FileUse **files, Arena *arena) {
+    ScriptLine *line = &lines[index];
+    if (line->barrier) {
+        // Waits for everything since (and including) the previous barrier
+        for (int e = lastBarrier < 0 ? 0 : lastBarrier; e < index; e++) {
+            if (lines[e].state == LINE_PENDING) {
+                int_list_push(&line->deps, &line->depCount, &line->depCapacity, e);
+            }
+        }
+        return;
+    }
+    if (lastBarrier >= 0) int_list_push(&line->deps, &line->depCount, &line->depCapacity, lastBarrier);
+
+    CommandLine *parsed = line->parsed;
+    for (int pass = 0; pass < 2; pass++) { // Dependencies first, then record this line's own uses
+        for (int c = 0; c < parsed->commandCount; c++) {
+            for (Pipeline *command = &parsed->commands[c]; command != NULL; command = command->next) {
+                for (int st = 0; st < command->stageCount; st++) {
+                    SimpleCommand *stage = &command->stages[st];
+                    for (int a = 0; a < stage->argCount; a++) {
+                        script_line_read(line, index, file_use_get(files, arena, stage->args[a]), pass);
+                    }
+                    for (int r = 0; r < stage->redirectCount; r++) {
+                        RedirectType type = stage->redirects[r].type;
+                        if (type == REDIRECT_DUP || type == REDIRECT_HERE_STRING) continue; // No file
+                        FileUse *use = file_use_get(files, arena, stage->redirects[r].target);
+                        if (type == REDIRECT_IN) {
+                            script_line_read(line, index, use, pass);
+                        } else if (pass == 0) {
+                            if (use->writer >= 0) {
+                                int_list_push(&line->deps, &line->depCount, &line->depCapacity, use->writer);
+                            }
+                            for (int k = 0; k < use->readerCount; k++) {
+                                if (use->readers[k] != index) {
+                                    int_list_push(&line->deps, &line->depCount, &line->depCapacity, use->readers[k]);
+                                }
+                            }
+                        } else {
+                            use->writer = index;
+                            use->readerCount = 0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+
+// Starts a line in a sub-shell whose stdout and stderr go to fresh memfds
+void script_line_start(ScriptLine *line) {
+    line->outFd = memfd_create("wish-stdout", MFD_CLOEXEC);
+    line->errFd = memfd_create("wish-stderr", MFD_CLOEXEC);
+    fflush(stdout); // Same as in spawn_process
+
+    pid_t pid = line->outFd == -1 || line->errFd == -1 ? -1 : fork();
+    if (pid == 0) {
+        dup2(line->outFd, STDOUT_FILENO);
+        dup2(line->errFd, STDERR_FILENO);
+        execute_command_line(line->parsed);
+        jobs_wait_all();
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "An error has occurred\n");
+        line->state = LINE_DONE;
+        line->status = 1;
+        return;
+    }
+    line->pid = pid;
+    line->state = LINE_RUNNING;
+}
+
+
+
+/**            ####     int run_parallel_script(int fd)    ####
+ * 
+ * --parallel-script: runs a batch script with independent lines at the same time instead of
+ * strictly one after another.
+ * 
+ * The whole script is parsed first and every line gets the earlier lines it depends on:
+ * 
+ *   - a line that writes a file ('>') an earlier line names, or names a file an earlier line
+ *     writes, waits for that line (found through a hash index of the file names, so building
+ *     the graph stays linear in the script size);
+ *   - a line running a builtin (cd, path, exit...) is a barrier: it waits for every earlier
+ *     line and runs in the shell itself, and every later line waits for it.
+ * 
+ * Up to --max-jobs lines (default: one per CPU) run at once, each in a forked sub-shell with its
+ * stdout and stderr captured in memfds. The captured output is written out strictly in script
+ * order once a line and all lines before it finished, so the output looks like a serial run.
+ * 
+ * Returns:
+ *   The exit code for the shell.
+ */
+int run_parallel_script(int fd) {
+    Arena scriptArena = { NULL, NULL }; // Holds the command trees of every line until the end
+    ScriptLine *lines = NULL;
+    int lineCount = 0, lineCapacity = 0;
+    int lastBarrier = -1;
+    FileUse *files[FILE_USE_BUCKETS] = { NULL }; // File index of the lines since lastBarrier
+
+    LineReader reader;
+    line_reader_init(&reader, fd);
+    const char *text;
+    size_t len;
+    while (line_reader_next(&reader, &text, &len)) {
+        if (lineCount == lineCapacity) {
+            lineCapacity = lineCapacity ? lineCapacity * 2 : 64;
+            lines = realloc(lines, lineCapacity * sizeof(ScriptLine));
+            if (lines == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ScriptLine *line = &lines[lineCount];
+        memset(line, 0, sizeof(*line));
+        line->parsed = parse_line(&scriptArena, text, len);
+        line->barrier = line_is_barrier(line->parsed);
+        line->outFd = line->errFd = -1;
+        line->state = line->parsed->commandCount == 0 ? LINE_DONE : LINE_PENDING;
+
+        if (line->state == LINE_PENDING) {
+            script_line_link(lines, lineCount, lastBarrier, files, &scriptArena);
+        }
+        if (line->barrier) {
+            lastBarrier = lineCount;
+            file_use_clear(files);
+        }
+        lineCount++;
+    }
+    line_reader_close(&reader);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int limit = max_parallel_jobs > 0 ? max_parallel_jobs : (cpus > 0 ? (int)cpus : 1);
+    int running = 0;
+    int nextFlush = 0; // First line whose output wasn't written yet
+    int firstPending = 0;
+
+    while (nextFlush < lineCount) {
+        // Write out the finished prefix of the script, in order
+        while (nextFlush < lineCount && lines[nextFlush].state == LINE_DONE) {
+            if (lines[nextFlush].outFd != -1) send_captured(lines[nextFlush].outFd, STDOUT_FILENO);
+            if (lines[nextFlush].errFd != -1) send_captured(lines[nextFlush].errFd, STDERR_FILENO);
+            nextFlush++;
+        }
+        while (firstPending < lineCount && lines[firstPending].state != LINE_PENDING) firstPending++;
+
+        // Start whatever is ready
+        for (int i = firstPending; i < lineCount && running < limit; i++) {
+            ScriptLine *line = &lines[i];
+            if (line->state != LINE_PENDING) continue;
+            bool ready = true;
+            for (int d = 0; d < line->depCount && ready; d++) {
+                ready = lines[line->deps[d]].state == LINE_DONE;
+            }
+            if (!ready) {
+                if (line->barrier) break; // Nothing after a barrier can be ready either
+                continue;
+            }
+            if (line->barrier) {
+                // Every earlier line is done and written, so this runs just like in a serial shell
+                if (nextFlush < i) break;
+                for (int e = i - 1; e >= 0; e--) {
+                    // "$?" is the status of the last line that ran something
+                    if (lines[e].parsed->commandCount > 0) {
+                        last_status = lines[e].status;
+                        break;
+                    }
+                }
+                execute_command_line(line->parsed);
+                line->status = last_status;
+                line->state = LINE_DONE;
+                break;
+            }
+            script_line_start(line);
+            if (line->state == LINE_RUNNING) running++;
+        }
+        if (running == 0) continue; // A barrier finished (or nothing could start), flush again
+
+        int status;
+        pid_t done = waitpid(-1, &status, 0);
+        if (done == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        bool ours = false;
+        for (int i = nextFlush; i < lineCount && !ours; i++) {
+            if (lines[i].state == LINE_RUNNING && lines[i].pid == done) {
+                lines[i].state = LINE_DONE;
+                lines[i].status = exit_code(status);
+                running--;
+                ours = true;
+            }
+        }
+        if (!ours) job_child_exited(done, status); // Background job of a barrier line
+    }
+
+    // Release the script memory
+    file_use_clear(files);
+    for (int i = 0; i < lineCount; i++) free(lines[i].deps);
+    for (ArenaChunk *chunk = scriptArena.first; chunk != NULL; ) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(lines);
+    jobs_wait_all();
+    return 0;
+}
+
+
+////////#########//////// END PARALLEL SCRIPT ////////#########////////
+
+
+
+
+////////#########//////// ZYGOTE POOL ////////#########////////
+
+
+// With --spawn=zygote the shell keeps a few idle helper processes around, forked ahead of time.
+// Starting a command is then one sendmsg() to a helper, which sets up the streams it was handed
+// and execs, and the pool is topped up again while the shell waits for commands anyway.
+
+#define ZYGOTE_MAX_POOL 64
+#define ZYGOTE_MSG_MAX 65536   // Largest command descriptor, bigger ones go through plain fork
+#define ZYGOTE_FDS 3           // stdin, stdout and stderr of the command
+
+// Fixed part of a command descriptor, followed by path, cwd, the redirections (a two character
+// type + fd code and the target each) and the arguments, all NUL terminated
 typedef struct {
-    char **paths; // Array of strings
-    int count;    // Number of paths
-    int capacity; // Current capacity of the array
-} PathList;
+    int argCount;
+    int redirectCount;
+} ZygoteHeader;
 
+typedef struct {
+    pid_t pid;
+    int sock; // Our end of the socketpair, SOCK_SEQPACKET so one message is one command
+} Zygote;
 
-// global struct to store PATH
-PathList globalPathList;
+Zygote zygotePool[ZYGOTE_MAX_POOL];
+int zygoteCount = 0;
+int zygote_pool_size = 4; // --zygote-pool=N
+pid_t zygoteOwner = 0;    // Only this process hands commands out, forked children just fork
 
+// Body of an idle helper: waits for one command descriptor and becomes that command
+void zygote_main(int sock) {
+    static char buffer[ZYGOTE_MSG_MAX];
+    char control[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    struct iovec iov = { buffer, sizeof(buffer) - 1 };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
 
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n < (ssize_t)sizeof(ZygoteHeader)) _exit(0); // Shell went away (or sent garbage)
 
-// Initialize the path list with a default size
-void initPathList(PathList *pathList, int capacity) {
-    pathList->paths = (char**)malloc(capacity * sizeof(char*));
-    // Check if malloc succeeded
-    if (pathList->paths == NULL) {
-        // Handle memory allocation failure
-        fprintf(stderr, "Error: Memory allocation failed in initPathList\n");
-        exit(EXIT_FAILURE); // Exit the program with a failure status
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(ZYGOTE_FDS * sizeof(int))) {
+        _exit(EXIT_FAILURE);
     }
-    pathList->count = 0;
-    pathList->capacity = capacity;
-}
+    int fds[ZYGOTE_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    close(sock);
+    prctl(PR_SET_PDEATHSIG, 0); // The command itself outlives the shell like any other child
 
+    ZygoteHeader header;
+    memcpy(&header, buffer, sizeof(header));
+    buffer[n] = '\0';
+    char *cursor = buffer + sizeof(header);
+    char *path = cursor;
+    cursor += strlen(cursor) + 1;
+    char *cwd = cursor;
+    cursor += strlen(cursor) + 1;
+    Redirect *redirects = alloca((header.redirectCount + 1) * sizeof(Redirect));
+    for (int i = 0; i < header.redirectCount; i++) {
+        redirects[i].type = cursor[0] - '0';
+        redirects[i].fd = cursor[1] - '0';
+        cursor += strlen(cursor) + 1;
+        redirects[i].target = cursor;
+        cursor += strlen(cursor) + 1;
+    }
+    char **args = alloca((header.argCount + 1) * sizeof(char *));
+    for (int i = 0; i < header.argCount; i++) {
+        args[i] = cursor;
+        cursor += strlen(cursor) + 1;
+    }
+    args[header.argCount] = NULL;
 
+    for (int i = 0; i < ZYGOTE_FDS; i++) dup2(fds[i], i); // Received fds are CLOEXEC, the copies not
+    if (chdir(cwd) == -1) _exit(EXIT_FAILURE);
+    if (apply_redirects(redirects, header.redirectCount) == 0) execv(path, args);
+    static const char error[] = "An error has occurred\n";
+    write_all(STDERR_FILENO, error, sizeof(error) - 1); // The helper exits either way
+    _exit(EXIT_FAILURE);
+}
 
+// Forks one more idle helper into the pool. Returns false if it could not be created
+bool zygote_spawn_one() {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) return false;
 
-// Free the memory used by the path list
-void freePathList(PathList *pathList) {
-    for (int i = 0; i < pathList->count; ++i) {
-        free(pathList->paths[i]); // Free each path string
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL); // Don't linger idle if the shell is killed
+        // Drop everything we inherited (pipe ends of running pipelines, the other helpers'
+        // sockets...) so no reader waits on us, and park the standard streams on /dev/null
+        int sock = pair[1];
+        syscall(SYS_close_range, 3, sock - 1, 0);
+        syscall(SYS_close_range, sock + 1, ~0U, 0);
+        int devNull = open("/dev/null", O_RDWR);
+        for (int i = 0; i < ZYGOTE_FDS; i++) dup2(devNull, i);
+        if (devNull >= ZYGOTE_FDS) close(devNull);
+        zygote_main(sock);
     }
-    free(pathList->paths); // Free the array of pointers
+    close(pair[1]);
+    if (pid < 0) {
+        close(pair[0]);
+        return false;
+    }
+    zygotePool[zygoteCount].pid = pid;
+    zygotePool[zygoteCount].sock = pair[0];
+    zygoteCount++;
+    return true;
 }
 
+// Tops the pool up to --zygote-pool helpers. Called while the shell waits for commands, so the
+// fork cost is not on the path from reading a line to exec'ing its commands
+void zygote_refill() {
+    if (spawn_backend != SPAWN_ZYGOTE || getpid() != zygoteOwner) return;
+    while (zygoteCount < zygote_pool_size) {
+        if (!zygote_spawn_one()) break;
+    }
+}
 
+// Fills the pool for this process. A --serve session first lets go of anything it inherited
+void zygote_start() {
+    if (spawn_backend != SPAWN_ZYGOTE) return;
+    while (zygoteCount > 0) close(zygotePool[--zygoteCount].sock);
+    zygoteOwner = getpid();
+    if (zygote_pool_size > ZYGOTE_MAX_POOL) zygote_pool_size = ZYGOTE_MAX_POOL;
+    zygote_refill();
+}
 
-// Clears the current paths and reallocates the paths array
-void clearPaths(PathList *pathList) {
-    freePathList(pathList); // Free current paths
-    initPathList(pathList, pathList->capacity); // Reinitialize
+// Appends a NUL terminated string to the descriptor. Returns false if it doesn't fit
+static bool zygote_put(char *buffer, size_t *length, const char *text) {
+    size_t n = strlen(text) + 1;
+    if (*length + n > ZYGOTE_MSG_MAX - 1) return false;
+    memcpy(buffer + *length, text, n);
+    *length += n;
+    return true;
 }
 
+/**            ####     pid_t spawn_with_zygote(const char *path, char **args, const SpawnIO *io)    ####
+ * 
+ * Hands the command to an idle helper of the pool: the resolved path, the arguments, our cwd
+ * and the redirections travel in one message, the three standard streams as SCM_RIGHTS. The
+ * helper is already our child, so its pid is the command's pid for waitpid() and pidfds.
+ * 
+ * Falls back to spawn_with_fork when the pool is empty, the command doesn't fit in a message,
+ * or we are not the process that owns the pool (a forked pipeline stage or batch line).
+ */
+pid_t spawn_with_zygote(const char *path, char **args, const SpawnIO *io) {
+    static char buffer[ZYGOTE_MSG_MAX];
 
+    if (getpid() != zygoteOwner || zygoteCount == 0) return spawn_with_fork(path, args, io);
 
-// Add a path to the list, expanding the array if necessary dynamicaly
-void addPath(PathList *pathList, const char *path) {
-    if (pathList->count == pathList->capacity) {
-        // Need more space
-        int newCapacity = pathList->capacity * 2;
-        char **newPaths = (char**)realloc(pathList->paths, newCapacity * sizeof(char*));
-        if (!newPaths) {
-            perror("Unable to expand path list");
-            return;
-        }
-        pathList->paths = newPaths;
-        pathList->capacity = newCapacity;
+    ZygoteHeader header = { 0, io->redirectCount };
+    while (args[header.argCount] != NULL) header.argCount++;
+
+    size_t length = sizeof(header);
+    char cwd[PATH_MAX];
+    bool fits = getcwd(cwd, sizeof(cwd)) != NULL &&
+                zygote_put(buffer, &length, path) && zygote_put(buffer, &length, cwd);
+    for (int i = 0; fits && i < io->redirectCount; i++) {
+        const Redirect *redirect = &io->redirects[i];
+        char code[3] = { '0' + redirect->type, '0' + redirect->fd, '\0' };
+        fits = zygote_put(buffer, &length, code) && zygote_put(buffer, &length, redirect->target);
     }
-    // Allocate space for the new path and copy it
-    pathList->paths[pathList->count] = strdup(path);
-    pathList->count++;
+    for (int i = 0; fits && i < header.argCount; i++) fits = zygote_put(buffer, &length, args[i]);
+    if (!fits) return spawn_with_fork(path, args, io);
+    memcpy(buffer, &header, sizeof(header));
+
+    int fds[ZYGOTE_FDS] = {
+        io->stdinFd != -1 ? io->stdinFd : STDIN_FILENO,
+        io->stdoutFd != -1 ? io->stdoutFd : STDOUT_FILENO,
+        STDERR_FILENO
+    };
+    union {
+        char bytes[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { buffer, length };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.bytes;
+    msg.msg_controllen = sizeof(control.bytes);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    Zygote zygote = zygotePool[--zygoteCount];
+    ssize_t sent;
+    do {
+        sent = sendmsg(zygote.sock, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    close(zygote.sock); // The helper only ever takes one command
+    if (sent == -1) {
+        // Helper died while idle, get rid of it and start the command the usual way
+        kill(zygote.pid, SIGKILL);
+        waitpid(zygote.pid, NULL, 0);
+        return spawn_with_fork(path, args, io);
+    }
+    return zygote.pid;
 }
 
 
+////////#########//////// END ZYGOTE POOL ////////#########////////
 
-// Initializes the default path. Its called always when the program starts.
-// For more default stuff, put it here using addPath like is used below.
-void initDefaultPath(PathList *pathList) {
-    addPath(pathList, "/bin"); // Add "/bin" as the default search path
-}
 
 
 
-// print the current paths at PATH
-void printCurrentPaths() {
-    printf("Current paths:\n");
-    if (globalPathList.count == 0) {
-        printf("  (empty)\n");
-    }
-    for (int i = 0; i < globalPathList.count; i++) {
-        printf("  %s\n", globalPathList.paths[i]);
-    }
-}
+////////#########//////// SERVER MODE ////////#########////////
 
 
-////////#########////////  END PATH HANDLING SHIT ////////#########//////// 
+#define FRAME_HEADER 5            // Type byte + 32 bit little endian payload length
+#define FRAME_MAX (16 << 20)      // Largest frame accepted, anything bigger ends the session
+#define RELAY_CHUNK 65536         // Output forwarded per frame
 
 
+// Frames of the --serve protocol. Every frame is a type byte, the payload length (uint32,
+// little endian) and the payload
+typedef enum {
+    FRAME_LINE = 'L',    // client -> server: one command line, without the newline
+    FRAME_STDOUT = 'O',  // server -> client: output of the line
+    FRAME_STDERR = 'E',  // server -> client: error output of the line
+    FRAME_STATUS = 'S'   // server -> client: the line finished, payload is its exit status (uint32)
+} FrameType;
 
-////////#########////////  SHELL EXECUTION LOGIC ////////#########//////// 
 
+// What the relay thread of a session forwards while a line runs
+typedef struct {
+    int outFd;   // Read end of the line's stdout pipe
+    int errFd;   // Read end of the line's stderr pipe
+    int client;  // Session socket
+} Relay;
 
-// Checks if a given command is builtin or not
-// returns 1 if built-in; if not buil-in returns 0
-int check_builtin_commands(char **args, int arg_count) {
-    if (strcmp(args[0], "exit") == 0) {
-        if (arg_count > 1) { // If there are more arguments after 'exit'
-            fprintf(stderr, "An error has occurred\n");
-            return 1; // Return 1 to indicate a built-in command was processed but with error
-        } else {
-            exit(0); // Correct use of exit
+
+
+// Sends one frame. MSG_NOSIGNAL: a client that went away ends the session, not the process
+int frame_send(int fd, FrameType type, const void *data, uint32_t len) {
+    unsigned char header[FRAME_HEADER] = { type, len & 0xff, (len >> 8) & 0xff, (len >> 16) & 0xff, len >> 24 };
+    struct iovec iov[2] = { { header, FRAME_HEADER }, { (void*)data, len } };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
-    } else if (strcmp(args[0], "cd") == 0) {
-        if (args[1] == NULL || args[2] != NULL) {
-            fprintf(stderr, "An error has occurred\n");
-        } else {
-            if (chdir(args[1]) != 0) {
-                perror("An error has occurred\n");
-            }
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
         }
-        return 1; // code indicating is a built in command
-    } 
-    if (strcmp(args[0], "path") == 0) {
-        clearPaths(&globalPathList); // Clear existing paths
-        for (int i = 1; i < arg_count; i++) {
-            addPath(&globalPathList, args[i]); // Add new paths
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
         }
-
-        if (debug_mode) {
-            printCurrentPaths(); // Print paths only if in debug mode
-        }        
-        return 1; // Indicating it's a built-in command
     }
-
-    return 0; // Not a built-in command
+    return 0;
 }
 
-// Parses commands and executes them
-void process_command(char *line) {
-    if (debug_mode) printf("Log: Starting process_command() with line: %s\n", line);
 
-    // Check if the line is empty or consists only of whitespace
-    if (is_line_empty_or_whitespace(line)) {
-        if (debug_mode) printf("Debug: Command is empty or whitespace\n");
-        return;
+
+// read() exactly `len` bytes. Returns 0, or -1 on EOF/error
+int read_full(int fd, void *data, size_t len) {
+    char *pos = data;
+    while (len > 0) {
+        ssize_t n = read(fd, pos, len);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        pos += n;
+        len -= n;
     }
+    return 0;
+}
+
+
 
-    // Explicit check for line consisting solely of '&'. The machete move as i like to call it
-    if (strcmp(line, "&\n") == 0 || strcmp(line, "&") == 0) {
-        if (debug_mode) printf("Debug: Line contains standalone '&' - Ignored.\n");
-        // Don't throw an error, just return
-        return;  
+// Receives one frame. The payload is malloc'd (NUL terminated) and must be freed.
+// Returns -1 when the peer closed the connection or sent garbage
+int frame_recv(int fd, FrameType *type, char **payload, uint32_t *len) {
+    unsigned char header[FRAME_HEADER];
+    if (read_full(fd, header, FRAME_HEADER) == -1) return -1;
+    *type = header[0];
+    *len = header[1] | (header[2] << 8) | (header[3] << 16) | ((uint32_t)header[4] << 24);
+    if (*len > FRAME_MAX) return -1;
+
+    *payload = malloc(*len + 1);
+    if (*payload == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (read_full(fd, *payload, *len) == -1) {
+        free(*payload);
+        return -1;
     }
+    (*payload)[*len] = '\0';
+    return 0;
+}
 
-    char** commands;
-    int num_commands = 0;
-    split_commands(line, &commands, &num_commands); // Split line into commands, potentially separated by '&'
-    if (debug_mode) printf("Debug: Number of commands to process: %d\n", num_commands);
 
-    if (num_commands > 1) {
-        // Handle all commands in parallel
-        if (debug_mode) printf("Debug: Preparing to execute multiple commands in parallel.\n");
-        execute_commands_in_parallel(commands, num_commands);
-    } else {
-        // Process a single command
-        if (debug_mode) printf("Log: Processing a single command: %s\n", commands[0]);
 
-        // Validate command before parsing arguments
-        if (commands[0][0] == '\0' || strcmp(commands[0], "&") == 0) {
-            if (debug_mode) printf("Debug: Invalid command or standalone '&'.\n");
-            fprintf(stderr, "An error has occurred\n");
-        } else {
-            char *args[MAX_LINE / 2 + 1];
-            parse_command_to_args(commands[0], args);
-            if (!check_builtin_commands(args, count_args(args))) {
-                execute_external_command(args); // Execute if not a built-in command
+// Relay thread: forwards the output of the running line as it's produced, until both pipes
+// reach EOF (every process of the line closed them)
+void* relay_output(void *arg) {
+    Relay *relay = arg;
+    struct pollfd fds[2] = { { relay->outFd, POLLIN, 0 }, { relay->errFd, POLLIN, 0 } };
+    FrameType types[2] = { FRAME_STDOUT, FRAME_STDERR };
+    char *buffer = malloc(RELAY_CHUNK);
+    if (buffer == NULL) return NULL;
+
+    int open = 2;
+    while (open > 0) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd == -1 || fds[i].revents == 0) continue;
+            ssize_t n = read(fds[i].fd, buffer, RELAY_CHUNK);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                fds[i].fd = -1; // poll() skips negative fds
+                open--;
+                continue;
             }
+            frame_send(relay->client, types[i], buffer, n); // A vanished client shows up on the next read
         }
     }
-
-    // Free dynamically allocated memory for commands
-    for (int i = 0; i < num_commands; i++) {
-        free(commands[i]);
-    }
-    free(commands);
-    if (debug_mode) printf("Debug: Finished processing all commands\n");
+    free(buffer);
+    return NULL;
 }
 
 
 
+// Runs one line of a session with its stdout/stderr streamed to the client. Returns -1 if the
+// session can't go on
+int serve_line(int client, const char *line, size_t len) {
+    int outPipe[2], errPipe[2];
+    if (pipe2(outPipe, O_CLOEXEC) == -1) return -1;
+    if (pipe2(errPipe, O_CLOEXEC) == -1) {
+        close(outPipe[0]);
+        close(outPipe[1]);
+        return -1;
+    }
 
+    fflush(stdout);
+    dup2(outPipe[1], STDOUT_FILENO); // Not O_CLOEXEC, the commands of the line inherit them
+    dup2(errPipe[1], STDERR_FILENO);
+    close(outPipe[1]);
+    close(errPipe[1]);
 
-////////#########//////// END SHELL EXECUTION LOGIC ////////#########////////
+    Relay relay = { outPipe[0], errPipe[0], client };
+    pthread_t thread;
+    bool relaying = pthread_create(&thread, NULL, relay_output, &relay) == 0;
 
+    process_command(line, len);
 
+    // Drop our write ends, the relay sees EOF once the line's processes are gone too
+    fflush(stdout);
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    close(devNull);
+    if (relaying) pthread_join(thread, NULL);
+    close(outPipe[0]);
+    close(errPipe[0]);
 
+    uint32_t status = last_status;
+    return frame_send(client, FRAME_STATUS, &status, sizeof(status));
+}
 
-////////#########//////// EXTERNAL EXECUTION LOGIC ////////#########////////
 
 
-/**            ####     char* findExecutable(char* command)    ####
- * 
- * Attempts to find the full path to an executable command.
- * 
- * This function searches for an executable file by the name specified in the `command` parameter.
- * If the command includes a slash (`/`), it is assumed to be either an absolute or a relative path,
- * and the function checks the specified path for executability. If no slash is present, the function
- * iterates through the directories listed in the global `PathList` (globalPathList), constructing
- * paths by combining each directory with the command name, and checks each for executability.
- * 
- * The search respects the order of directories in `globalPathList`, returning the path to the
- * first executable match found.
- * 
- * Parameters:
- *   command - A string representing the command to find. This can be just the name of the command
- *             (for example "ls") or a path to the command (either absolute like "/bin/ls" or relative like
- *             "./give_permissions_to_all_scripts.sh").
- * 
- * Returns:
- *   A dynamically allocated string containing the full path to the executable command if found.
- *   The caller is responsible for freeing this string using `free`.
- *   If the command is not found or is not executable, returns NULL.
- * 
- * Note:
- *   The function uses `access()` with the `X_OK` flag to check for the command's executability.
- *   If `command` contains a slash, it's directly checked without searching `globalPathList`.
- */
-char* findExecutable(char* command) {
-    if (strchr(command, '/') != NULL) {
-        // Command already contains a path (absolute or relative)
-        if (access(command, X_OK) == 0) {
-            return strdup(command); // Return the command as is
-        }
-    } else {
-        // Search for the command in the specified paths
-        for (int i = 0; i < globalPathList.count; i++) {
-            char path[1024];
-            snprintf(path, sizeof(path), "%s/%s", globalPathList.paths[i], command);
-            if (access(path, X_OK) == 0) {
-                return strdup(path); // Return the full path to the executable
-            }
-        }
+// A client session, in its own forked process: own cwd, path list and executable cache, all
+// starting as copies of the (warm) server's
+void serve_session(int client) {
+    int devNull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    dup2(devNull, STDIN_FILENO); // Commands must not read the server's stdin
+    close(devNull);
+    zygote_start(); // Helpers must be our children to be waited for
+
+    FrameType type;
+    char *payload;
+    uint32_t len;
+    while (frame_recv(client, &type, &payload, &len) == 0) {
+        int result = 0;
+        if (type == FRAME_LINE) result = serve_line(client, payload, len);
+        free(payload);
+        if (result == -1) break;
     }
-    return NULL; // Command not found
+    close(client);
+    jobs_wait_all();
+    exit(0);
 }
 
 
 
-/**       
- * Executes an external command with optional output redirection.
+/**            ####     int run_server(const char *socketPath)    ####
  * 
- * This function is responsible for executing a command specified by the `args` array, 
- * handling output redirection if a '>' operator is present among the arguments. The command 
- * to execute is determined by `args[0]`, and any arguments to the command follow in the array. 
- * If redirection is specified (indicated by '>'), the output of the command is written to the 
- * file named immediately after this operator, creating or truncating the file as necessary.
+ * --serve=SOCKET: keeps one warm shell around and runs command lines sent over a UNIX domain
+ * stream socket, so callers don't pay the startup of a new wish process per job.
  * 
- * The function first searches for the executable in the filesystem using `findExecutable`, 
- * which checks both directly specified paths (e.g., "./script.sh" or "/bin/ls") and searches 
- * the directories listed in the global path list for the executable. It then forks a new process 
- * to execute the command. In the child process, if redirection is specified, it adjusts the 
- * standard output to the target file before executing the command using `execv`. The parent 
- * process waits for the child process to complete before returning.
- * 
- * Detailed logging statements are included to facilitate debugging and tracing the execution 
- * flow, including indicating when redirection is handled, when the child process is forked, 
- * and when execution of the external command is attempted.
- * 
- * @param args An array of strings representing the command and its arguments. The last element 
- *             must be NULL. If redirection is specified, the array will include a '>' followed 
- *             by a filename, and the array will be terminated before the '>' for execv execution.
+ * Every connection gets a session: a forked copy of the server with its own cwd, path list and
+ * executable cache, which start out as the server's (a script given together with --serve is
+ * run first, e.g. to set the path and `hash` the usual commands). The client sends FRAME_LINE
+ * frames; each line runs through process_command() with stdout and stderr on pipes that a relay
+ * thread forwards as FRAME_STDOUT/FRAME_STDERR frames while the line runs, and a FRAME_STATUS
+ * frame with its exit status ends it. `exit` ends the session.
+ * 
+ * Returns:
+ *   1 if the socket couldn't be set up; otherwise it serves until killed.
  */
-void execute_external_command(char **args) {
-    if (debug_mode) printf("Log: Starting execute_external_command()\n");
-    
-    int redirect_index = -1;
-    int fd = -1; // File descriptor for redirection, if needed
-
-    // Search for redirection symbol ('>') and note its index
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], ">") == 0) {
-            redirect_index = i;
-            if (debug_mode) printf("Log: Redirection found at index %d\n", redirect_index);
-            break;
-        }
+int run_server(const char *socketPath) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
     }
+    strcpy(addr.sun_path, socketPath);
 
-    if (redirect_index != -1) {
-        // Check if there's no file name after '>'
-        if (args[redirect_index + 1] == NULL) {
-            fprintf(stderr, "An error has occurred\n");
-            return; // Return without trying to execute anything
-        }
+    struct stat st;
+    if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socketPath); // Stale socket
 
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server == -1 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(server, SOMAXCONN) == -1) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
+    }
+    if (debug_mode) printf("Debug: Serving on %s\n", socketPath);
 
-        // Check if there is more than one file name after '>'
-        if (args[redirect_index + 2] != NULL) {
+    for (;;) {
+        int client = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+        while (waitpid(-1, NULL, WNOHANG) > 0) {} // Sessions that ended meanwhile
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
             fprintf(stderr, "An error has occurred\n");
-            return; // Return without executing as only one file should follow '>'
+            return 1;
         }
 
-        fd = open(args[redirect_index + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-            perror("wish: open");
-            return;
+        fflush(stdout); // Same as in spawn_process
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(server);
+            serve_session(client);
         }
+        if (pid < 0) fprintf(stderr, "An error has occurred\n");
+        close(client);
     }
+}
 
-    char* executablePath = findExecutable(args[0]);
-    if (!executablePath) {
+
+
+// --connect=SOCKET: sends every line of `fd` to a --serve shell and prints what comes back.
+// Returns the exit status of the last line
+int run_client(const char *socketPath, int fd) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketPath);
+
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server == -1 || connect(server, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
         fprintf(stderr, "An error has occurred\n");
-        return;
+        return 1;
     }
 
-    pid_t pid = fork();
-
-    if (pid == 0) { // Child process
-        if (debug_mode) {
-            printf("Log: Forked in execute_external_command() with pid = 0\n");
-            printf("Log: In child process (execute_external_command)\n");
-        }
-        // Handle redirection by replacing STDOUT
-        if (redirect_index != -1) {
-            fd = open(args[redirect_index + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fsync(fd) == -1) {
-                perror("An error has occurred\n");
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-            args[redirect_index] = NULL; // Terminate args before '>'
-        }
+    LineReader reader;
+    line_reader_init(&reader, fd);
+    const char *line;
+    size_t len;
+    uint32_t status = 0;
+    bool connected = true;
+    while (connected && line_reader_next(&reader, &line, &len)) {
+        if (frame_send(server, FRAME_LINE, line, len) == -1) break;
 
-        // Execute the command
-        if (debug_mode) printf("Log: Executing %s\n", executablePath);
-        if (execv(executablePath, args) == -1) {
-            perror("An error has occurred\n");
-            exit(EXIT_FAILURE);
+        FrameType type;
+        char *payload;
+        uint32_t payloadLen;
+        while ((connected = frame_recv(server, &type, &payload, &payloadLen) == 0)) {
+            if (type == FRAME_STDOUT) write_all(STDOUT_FILENO, payload, payloadLen);
+            if (type == FRAME_STDERR) write_all(STDERR_FILENO, payload, payloadLen);
+            if (type == FRAME_STATUS && payloadLen == sizeof(status)) memcpy(&status, payload, sizeof(status));
+            free(payload);
+            if (type == FRAME_STATUS) break;
         }
-    } else if (pid > 0) {
-        if (debug_mode) printf("Log: Forked in execute_external_command() with pid = %d\n", pid);
-        // Parent process waits for the child process to complete
-        int status;
-        waitpid(pid, &status, 0);
-        if (debug_mode) printf("Log: Child process completed\n");
-    } else {
-        perror("An error has occurred\n");
     }
-    
-    free(executablePath); // Free dynamically allocated path
-    if (debug_mode) printf("Log: Finished execute_external_command()\n");
+    line_reader_close(&reader);
+    close(server);
+    return status;
 }
 
 
+////////#########//////// END SERVER MODE ////////#########////////
 
 
-void execute_commands_in_parallel(char **commands, int num_commands) {
-    if (debug_mode) {
-        printf("Log: Starting execute_commands_in_parallel() with %d commands\n", num_commands);
-    }
-    
-    pid_t pids[num_commands]; // Array to store child PIDs
 
-    for (int i = 0; i < num_commands; i++) {
-        if (debug_mode) {
-            printf("Log: Forking command %d in execute_commands_in_parallel(): %s\n", i, commands[i]);
-        }
 
-        pids[i] = fork();
-        
-        if (pids[i] == 0) { // Child process
-            char *args[MAX_LINE / 2 + 1]; // Array for command arguments
-            parse_command_to_args(commands[i], args); // Parse command string to args
-            
-            if (debug_mode && args[1] && strcmp(args[1], ">") == 0) {
-                printf("Debug: Redirecting output of command to file: %s\n", args[2]);
-            }
+////////#########//////// BENCHMARK MODE ////////#########////////
 
-            if (!check_builtin_commands(args, count_args(args))) {
-                execute_external_command(args); // Execute if not a built-in command
-            }
-            exit(0); // Exit after execution
-        } else if (pids[i] < 0) {
-            perror("Fork failed");
-            exit(EXIT_FAILURE); // Forking failed
-        } else {
-            if (debug_mode) {
-                printf("Log: Successfully forked child process %d\n", pids[i]);
-            }
-        }
+
+/**            ####     int run_benchmark(const char *scriptPath, int iterations)    ####
+ * 
+ * Runs a batch script `iterations` times with every phase probe enabled and prints a report
+ * on stderr: per-phase latency (count, mean, min, p50, p90, p99, max in microseconds), the
+ * wall time of each run and the overall commands/sec. Command output still goes to stdout,
+ * redirect it to /dev/null to keep the terminal out of the numbers.
+ * 
+ * Every run starts like a fresh shell: same cwd, default path and an empty executable cache.
+ * `exit` in the script ends the current run instead of the shell.
+ */
+int run_benchmark(const char *scriptPath, int iterations) {
+    int cwdFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    uint64_t *runTimes = malloc(iterations * sizeof(uint64_t));
+    if (cwdFd == -1 || runTimes == NULL) {
+        fprintf(stderr, "An error has occurred\n");
+        return 1;
     }
+    bench_mode = 1;
 
-    // Parent waits for all child processes
-    for (int i = 0; i < num_commands; i++) {
-        int status;
-        if (debug_mode) {
-            printf("Log: Waiting for command %d (PID %d) to finish in execute_commands_in_parallel()\n", i, pids[i]);
-        }
+    uint64_t totalTime = 0;
+    for (int run = 0; run < iterations; run++) {
+        if (fchdir(cwdFd) == -1) break;
+        clearPaths(&globalPathList);
+        initDefaultPath(&globalPathList);
+        execCacheClear();
+        bench_stop_iteration = 0;
 
-        waitpid(pids[i], &status, 0);
+        int fd = open(scriptPath, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "An error has occurred\n");
+            return 1;
+        }
+        LineReader reader;
+        line_reader_init(&reader, fd);
 
-        if (debug_mode) {
-            if (WIFEXITED(status)) {
-                printf("Debug: Process %d exited with status %d\n", pids[i], WEXITSTATUS(status));
-            } else if (WIFSIGNALED(status)) {
-                printf("Debug: Process %d killed by signal %d\n", pids[i], WTERMSIG(status));
-            }
+        uint64_t start = now_ns();
+        const char *line;
+        size_t len;
+        while (!bench_stop_iteration && line_reader_next(&reader, &line, &len)) {
+            process_command(line, len);
         }
+        jobs_wait_all(); // Background jobs are part of the run
+        runTimes[run] = now_ns() - start;
+        totalTime += runTimes[run];
+        line_reader_close(&reader);
     }
-    if (debug_mode) {
-        printf("Log: Ending execute_commands_in_parallel()\n");
-    }
-}
+    if (fchdir(cwdFd) == -1) fprintf(stderr, "An error has occurred\n"); // Report still follows
+    close(cwdFd);
 
+    const char *backends[] = { "fork", "vfork", "posix_spawn", "zygote" };
+    fprintf(stderr, "wish bench: %s, %d runs, spawn=%s\n", scriptPath, iterations, backends[spawn_backend]);
+    fprintf(stderr, "  %-10s %8s %10s %10s %10s %10s %10s %10s\n",
+            "phase(us)", "count", "mean", "min", "p50", "p90", "p99", "max");
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        print_bench_row(benchPhaseNames[phase], benchSamples[phase].samples, benchSamples[phase].count);
+    }
+    print_bench_row("run", runTimes, iterations);
+    fprintf(stderr, "  commands: %llu, %.1f commands/sec\n", (unsigned long long)benchCommands,
+            totalTime ? benchCommands / (totalTime / 1e9) : 0.0);
 
+    free(runTimes);
+    return 0;
+}
 
 
-////////#########//////// END EXTERNAL EXECUTION LOGIC ////////#########////////
+////////#########//////// END BENCHMARK MODE ////////#########////////
 
 
 
@@ -525,45 +6639,216 @@ void execute_commands_in_parallel(char **commands, int num_commands) {
 int main(int argc, char *argv[]) {
     initPathList(&globalPathList, 10);
     initDefaultPath(&globalPathList);
+    initExecCache(&globalExecCache, 64);
 
-    FILE *input_stream = stdin;
+    int input_fd = STDIN_FILENO;
+    const char *scriptPath = NULL;
+    int benchIterations = 0; // > 0 when --bench was given
+    const char *serveSocket = NULL;   // --serve
+    const char *connectSocket = NULL; // --connect
     bool isInteractive = true; // Default to interactive mode
+    bool lineEditing = true;          // --no-edit turns the line editor off
+    const char *historyPath = NULL;   // --history, default ~/.wish_history
+    bool historyDefault = true;
 
     // Parse command-line arguments
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--debug") == 0) {
             debug_mode = 1;
+        } else if (strncmp(argv[i], "--spawn=", 8) == 0) {
+            const char *backend = argv[i] + 8;
+            if (strcmp(backend, "fork") == 0) {
+                spawn_backend = SPAWN_FORK;
+            } else if (strcmp(backend, "vfork") == 0) {
+                spawn_backend = SPAWN_VFORK;
+            } else if (strcmp(backend, "posix_spawn") == 0) {
+                spawn_backend = SPAWN_POSIX_SPAWN;
+            } else if (strcmp(backend, "zygote") == 0) {
+                spawn_backend = SPAWN_ZYGOTE;
+            } else {
+                fprintf(stderr, "An error has occurred\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[i], "--zygote-pool=", 14) == 0) {
+            zygote_pool_size = atoi(argv[i] + 14);
+            if (zygote_pool_size < 1) {
+                fprintf(stderr, "An error has occurred\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[i], "--max-jobs=", 11) == 0) {
+            const char *value = argv[i] + 11;
+            if (strcmp(value, "auto") == 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN); // One job per online CPU
+                max_parallel_jobs = cpus > 0 ? (int)cpus : 1;
+            } else {
+                max_parallel_jobs = atoi(value);
+                if (max_parallel_jobs < 0) {
+                    fprintf(stderr, "An error has occurred\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        } else if (strcmp(argv[i], "--no-splice") == 0) {
+            splice_fast_path = 0;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            benchIterations = 5;
+        } else if (strncmp(argv[i], "--bench=", 8) == 0) {
+            benchIterations = atoi(argv[i] + 8);
+            if (benchIterations <= 0) {
+                fprintf(stderr, "An error has occurred\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--compile-cache") == 0) {
+            compile_cache = 1;
+        } else if (strncmp(argv[i], "--compile-cache=", 16) == 0) {
+            compile_cache = 1;
+            compile_cache_dir = argv[i] + 16;
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            incremental = 1;
+        } else if (strncmp(argv[i], "--incremental=", 14) == 0) {
+            incremental = 1;
+            incremental_dir = argv[i] + 14;
+        } else if (strcmp(argv[i], "--hash-revalidate") == 0) {
+            hash_revalidate = 1;
+        } else if (strcmp(argv[i], "--background") == 0) {
+            background_jobs = 1;
+        } else if (strncmp(argv[i], "--parallel-output=", 18) == 0) {
+            const char *mode = argv[i] + 18;
+            if (strcmp(mode, "ordered") == 0) {
+                parallel_output = OUTPUT_ORDERED;
+            } else if (strcmp(mode, "prefix") == 0) {
+                parallel_output = OUTPUT_PREFIX;
+            } else if (strcmp(mode, "direct") == 0) {
+                parallel_output = OUTPUT_DIRECT;
+            } else {
+                fprintf(stderr, "An error has occurred\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--no-native-utils") == 0) {
+            native_utilities = 0;
+        } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            serveSocket = argv[i] + 8;
+        } else if (strncmp(argv[i], "--connect=", 10) == 0) {
+            connectSocket = argv[i] + 10;
+        } else if (strcmp(argv[i], "--no-edit") == 0) {
+            lineEditing = false;
+        } else if (strncmp(argv[i], "--history=", 10) == 0) {
+            historyPath = argv[i][10] != '\0' ? argv[i] + 10 : NULL; // Empty: keep no history file
+            historyDefault = false;
+        } else if (strcmp(argv[i], "--parallel-script") == 0) {
+            parallel_script = 1;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            if (trace_enabled || trace_start(argv[i] + 8) == -1) {
+                fprintf(stderr, "An error has occurred\n");
+                exit(EXIT_FAILURE);
+            }
         } else if (strcmp(argv[i], "--help") == 0) {
             printf("Usage: wish [options] [script]\n");
             printf("Options:\n");
             printf("  --help        Display this help message and exit\n");
             printf("  --debug       Run in debug mode\n");
+            printf("  --spawn=MODE  Start commands with fork (default), vfork, posix_spawn or zygote\n");
+            printf("  --zygote-pool=N  Idle pre-forked helpers kept for --spawn=zygote (default 4)\n");
+            printf("  --max-jobs=N  Run at most N '&' commands at once (auto = CPU count, 0 = no limit)\n");
+            printf("  --no-splice   Exec real cat/tee in pipelines instead of splicing in-shell\n");
+            printf("  --compile-cache[=DIR]  Cache the parsed script (default dir ~/.cache/wish)\n");
+            printf("  --incremental[=DIR]  Skip 'cmd > file' when it already made file from the same inputs\n");
+            printf("  --bench[=N]   Run the script N times (default 5) and report per-phase latency\n");
+            printf("  --hash-revalidate  Recheck PATH directory mtimes before using a cached lookup\n");
+            printf("  --background  A line ending in '&' runs as a background job (see jobs, wait)\n");
+            printf("  --parallel-output=MODE  Output of '&' commands: direct (default), ordered or prefix\n");
+            printf("  --no-native-utils  Exec the real echo/true/false/cat/test instead of the builtins\n");
+            printf("  --serve=SOCKET    Run lines sent over a UNIX socket, a session per client\n");
+            printf("  --connect=SOCKET  Send the input to a --serve shell instead of running it\n");
+            printf("  --no-edit     Read interactive input as plain lines, without the line editor\n");
+            printf("  --history=FILE  Interactive history file (default ~/.wish_history, empty = none)\n");
+            printf("  --parallel-script  Run independent script lines at once, output stays in order\n");
+            printf("  --trace=FILE  Record every phase of every command to FILE (Chrome trace JSON)\n");
             return 0;  // Exit after displaying help
         } else {
             // Assume any other argument is a batch script filename
-            input_stream = fopen(argv[i], "r");
-            if (!input_stream) {
+            input_fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+            if (input_fd == -1) {
                 // fprintf(stderr, "Error: Cannot open file '%s'\n", argv[i]);
                 fprintf(stderr, "An error has occurred\n");  // general error message
                 exit(EXIT_FAILURE);
             }
+            scriptPath = argv[i];
             isInteractive = false; // Not interactive mode if a script file is specified
         }
     }
 
-    char *line = NULL;
-    size_t linecap = 0;
+    if (connectSocket == NULL && serveSocket == NULL) zygote_start();
+    if (incremental && connectSocket == NULL) incremental_start();
+
+    if (benchIterations > 0) {
+        if (scriptPath == NULL) {
+            fprintf(stderr, "An error has occurred\n"); // Needs a script to replay
+            exit(EXIT_FAILURE);
+        }
+        close(input_fd);
+        return run_benchmark(scriptPath, benchIterations);
+    }
+
+    if (connectSocket != NULL) {
+        return run_client(connectSocket, input_fd);
+    }
+
+    if (serveSocket != NULL) {
+        if (scriptPath != NULL) {
+            // Warm up first: the script's path, cd and hash carry over into every session
+            LineReader warmup;
+            line_reader_init(&warmup, input_fd);
+            const char *line;
+            size_t len;
+            while (line_reader_next(&warmup, &line, &len)) process_command(line, len);
+            line_reader_close(&warmup);
+        }
+        return run_server(serveSocket);
+    }
+
+    if (parallel_script && scriptPath != NULL) {
+        if (debug_mode) printf("Debug: Starting shell in batch mode (parallel script)\n");
+        return run_parallel_script(input_fd);
+    }
+
+    if (compile_cache && scriptPath != NULL) {
+        if (debug_mode) printf("Debug: Starting shell in batch mode (compile cache)\n");
+        if (run_script_with_compile_cache(scriptPath)) {
+            close(input_fd);
+            jobs_wait_all();
+            return 0;
+        }
+    }
 
     if (debug_mode) {
         printf("Debug: Starting shell in %s mode\n", isInteractive ? "interactive" : "batch");
     }
 
+    if (isInteractive && lineEditing && editor_usable()) {
+        char defaultHistory[PATH_MAX];
+        const char *home = getenv("HOME");
+        if (historyDefault && home != NULL) {
+            snprintf(defaultHistory, sizeof(defaultHistory), "%s/.wish_history", home);
+            historyPath = defaultHistory;
+        }
+        run_line_editor(historyPath);
+        jobs_wait_all();
+        return 0;
+    }
+
+    LineReader reader;
+    line_reader_init(&reader, input_fd);
+    shellInput = &reader;
+
     if (isInteractive) {
         printf("wish> "); // Print the prompt
+        fflush(stdout);
     }
 
-    while (getline(&line, &linecap, input_stream) != -1) {
-        process_command(line); 
+    const char *line;
+    size_t len;
+    while (line_reader_next(&reader, &line, &len)) {
+        process_command(line, len);
         
         if (isInteractive) {
             printf("wish> ");
@@ -571,11 +6856,9 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (!isInteractive && input_stream != stdin) {
-        fclose(input_stream); // Close the batch file if opened
-    }
-
-    free(line);
+    shellInput = NULL;
+    line_reader_close(&reader); // Unmaps/closes the batch file if opened
+    jobs_wait_all(); // Like exit, don't leave background jobs behind
     if (debug_mode && isInteractive) {
         printf("Debug: Exiting shell\n");
     }
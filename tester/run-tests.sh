@@ -117,12 +117,13 @@ run_and_check () {
 
 # usage: call when args not parsed, or when help needed
 usage () {
-    echo "usage: run-tests.sh [-h] [-v] [-t test] [-c] [-s] [-d testdir]"
+    echo "usage: run-tests.sh [-h] [-v] [-t test] [-c] [-s] [-p] [-d testdir]"
     echo "  -h                help message"
     echo "  -v                verbose"
     echo "  -t n              run only test n"
     echo "  -c                continue even after failure"
     echo "  -s                skip pre-test initialization"
+    echo "  -p                run the performance suite (testdir/perf) instead of the tests"
     echo "  -d testdir        run tests from testdir"
     return 0
 }
@@ -134,9 +135,10 @@ verbose=0
 testdir="tests"
 contrunning=0
 skippre=0
+perf=0
 specific=""
 
-args=`getopt hvsct:d: $*`
+args=`getopt hvscpt:d: $*`
 if [[ $? != 0 ]]; then
     usage; exit 1
 fi
@@ -157,6 +159,9 @@ for i; do
     -s)
         skippre=1
         shift;;
+    -p)
+        perf=1
+        shift;;
     -t)
         specific=$2
 	shift
@@ -175,6 +180,15 @@ for i; do
     esac
 done
 
+# performance suite: the project's perf script decides what to run and when it failed
+if (( $perf == 1 )); then
+    if [[ ! -f $testdir/perf ]]; then
+	echo "no performance suite in $testdir/perf" >&2; exit 1
+    fi
+    source $testdir/perf
+    exit $?
+fi
+
 # need a test directory; must be named "tests-out"
 if [[ ! -d tests-out ]]; then
     mkdir tests-out
@@ -1,44 +1,407 @@
+#define _GNU_SOURCE // Para wait4()
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
+#include <stddef.h> // Para offsetof()
+#include <math.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h> // Para SYS_pidfd_open
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Uso: %s <comando>\n", argv[0]);
-        return 1;
+// Metricas de una ejecucion del comando
+typedef struct {
+    double wall;       // Tiempo real en segundos
+    double user;       // CPU en modo usuario (s)
+    double sys;        // CPU en modo kernel (s)
+    double maxrss;     // Memoria residente maxima (KiB)
+    double minflt;     // Fallos de pagina menores
+    double majflt;     // Fallos de pagina mayores
+    double nvcsw;      // Cambios de contexto voluntarios
+    double nivcsw;     // Cambios de contexto involuntarios
+    double peak_rss;   // Con -s: maximo de la RSS sumada del hijo y sus descendientes (KiB)
+    double peak_cpu;   // Con -s: maximo uso de CPU entre dos muestras (%, 100 = un nucleo)
+    double peak_threads; // Con -s: maximo de hilos vivos en todo el arbol
+    int status;        // Codigo de salida (o 128 + senal)
+} Run;
+
+// Nombre y posicion de cada metrica dentro de Run, para los reportes
+typedef struct {
+    const char *name;
+    size_t offset;
+} Metric;
+
+static const Metric metrics[] = {
+    { "wall_s",    offsetof(Run, wall) },
+    { "user_s",    offsetof(Run, user) },
+    { "sys_s",     offsetof(Run, sys) },
+    { "maxrss_kb", offsetof(Run, maxrss) },
+    { "minflt",    offsetof(Run, minflt) },
+    { "majflt",    offsetof(Run, majflt) },
+    { "nvcsw",     offsetof(Run, nvcsw) },
+    { "nivcsw",    offsetof(Run, nivcsw) },
+    // Solo con muestreo (-s)
+    { "peak_rss_kb",  offsetof(Run, peak_rss) },
+    { "peak_cpu_pct", offsetof(Run, peak_cpu) },
+    { "peak_threads", offsetof(Run, peak_threads) },
+};
+#define NUM_BASE_METRICS 8 // Las que no dependen del muestreo, siempre al principio
+#define NUM_ALL_METRICS (sizeof(metrics) / sizeof(metrics[0]))
+
+// Metricas reportadas: las de muestreo se agregan con -s
+static size_t num_metrics = NUM_BASE_METRICS;
+
+// Muestreo (-s): mientras el hijo corre se lee /proc de el y de sus descendientes cada
+// `sample_interval` segundos y cada muestra es una fila de la linea de tiempo
+static double sample_interval = 0; // 0 = sin muestreo
+static FILE *timeline = NULL;      // Destino de la linea de tiempo (-T, por defecto stderr)
+static long clock_ticks;           // Ticks por segundo de utime/stime en /proc
+static long page_kb;               // KiB por pagina, la RSS de /proc/<pid>/stat esta en paginas
+
+// Una muestra, sumada sobre todo el arbol de procesos del hijo
+typedef struct {
+    double rss_kb;
+    double cpu_ticks;  // utime + stime (+ los de hijos ya recogidos) acumulados
+    int threads;
+    int procs;
+} Sample;
+
+// Estadisticas de una metrica sobre todas las ejecuciones medidas
+typedef struct {
+    double mean, stddev, min, p50, p95, max;
+} Stats;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double tv_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Suma /proc/<pid>/stat a la muestra y sigue con los hijos de cada hilo del proceso.
+// Un proceso que termina a mitad de camino simplemente no aparece
+static void sample_tree(pid_t pid, Sample *sample, int depth) {
+    char path[320], buf[1024]; // path: /proc/<pid>/task/<tid>/children
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return;
+    buf[n] = '\0';
+
+    // El nombre (campo 2) puede tener espacios y parentesis: se sigue despues del ultimo ')'.
+    // Desde el campo 3: utime(14) stime(15) cutime(16) cstime(17) num_threads(20) rss(24)
+    char *fields = strrchr(buf, ')');
+    unsigned long utime, stime;
+    long cutime, cstime, threads, rss;
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld %*d %*d %ld %*d %*u %*u %ld",
+                                 &utime, &stime, &cutime, &cstime, &threads, &rss) != 6) {
+        return;
     }
+    // cutime/cstime: los hijos ya recogidos pasan su CPU al padre, asi el total no baja
+    sample->cpu_ticks += utime + stime + cutime + cstime;
+    sample->rss_kb += rss * page_kb;
+    sample->threads += threads;
+    sample->procs++;
+    if (depth >= 64) return;
+
+    // Hijos: /proc/<pid>/task/<tid>/children, una lista de pids por hilo
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *tasks = opendir(path);
+    if (tasks == NULL) return;
+    struct dirent *task;
+    while ((task = readdir(tasks)) != NULL) {
+        if (task->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/children", (int)pid, task->d_name);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) continue;
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0) continue;
+        buf[n] = '\0';
+        char *next = buf, *end;
+        for (long child = strtol(next, &end, 10); end != next; child = strtol(next, &end, 10)) {
+            next = end;
+            sample_tree((pid_t)child, sample, depth + 1);
+        }
+    }
+    closedir(tasks);
+}
+
+// Muestrea al hijo hasta que termina, sin recogerlo (de eso se encarga wait4). Espera con un
+// pidfd, asi despierta apenas el hijo termina en vez de al final del intervalo
+static void sample_child(pid_t pid, double start, int runNumber, Run *run) {
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    double prevTime = start, prevTicks = 0, next = start;
+
+    for (;;) {
+        next += sample_interval; // Horario fijo: las muestras no se van corriendo
+        double wait = next - now_seconds();
+        if (wait > 0) {
+            struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+            if (pidfd != -1) {
+                struct pollfd pfd = { pidfd, POLLIN, 0 };
+                if (ppoll(&pfd, 1, &ts, NULL) > 0) break; // El hijo termino
+            } else {
+                nanosleep(&ts, NULL);
+            }
+        }
+        siginfo_t info;
+        info.si_pid = 0;
+        if (pidfd == -1 && waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid) break;
 
-    struct timeval start, end;
-    pid_t pid;
+        Sample sample = { 0, 0, 0, 0 };
+        sample_tree(pid, &sample, 0);
+        double t = now_seconds();
+        double cpu = t > prevTime ? (sample.cpu_ticks - prevTicks) / clock_ticks / (t - prevTime) * 100 : 0;
+        if (cpu < 0) cpu = 0; // Un descendiente termino sin que nadie lo recogiera
+        prevTicks = sample.cpu_ticks;
+        prevTime = t;
+
+        if (sample.rss_kb > run->peak_rss) run->peak_rss = sample.rss_kb;
+        if (cpu > run->peak_cpu) run->peak_cpu = cpu;
+        if (sample.threads > run->peak_threads) run->peak_threads = sample.threads;
+        fprintf(timeline, "%d,%.3f,%.0f,%.1f,%d,%d\n", runNumber, t - start, sample.rss_kb, cpu,
+                sample.threads, sample.procs);
+    }
+    if (pidfd != -1) close(pidfd);
+}
+
+// Ejecuta el comando una vez y llena las metricas. Retorna -1 si no se pudo crear el proceso.
+// `runNumber` numera las filas de la linea de tiempo; 0 (calentamiento) no se muestrea
+static int run_once(char **command, Run *run, int runNumber) {
+    struct rusage usage;
     int status;
 
     // Obtener el tiempo de inicio
-    gettimeofday(&start, NULL);
+    double start = now_seconds();
 
-    pid = fork();
+    pid_t pid = fork();
     if (pid == -1) {
         // Error al crear el proceso hijo
         perror("fork");
-        return 1;
+        return -1;
     } else if (pid == 0) {
         // Proceso hijo: ejecuta el comando
-        execvp(argv[1], &argv[1]);
+        execvp(command[0], command);
         // Si execvp retorna, entonces hubo un error
         perror("execvp");
-        exit(1);
-    } else {
-        // Proceso padre: espera a que el hijo termine
-        waitpid(pid, &status, 0);
+        exit(127);
+    }
+
+    // Proceso padre: muestrea mientras corre, luego lo espera y recoge su consumo de recursos
+    run->peak_rss = run->peak_cpu = run->peak_threads = 0;
+    if (sample_interval > 0 && runNumber > 0) sample_child(pid, start, runNumber, run);
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        return -1;
+    }
+    run->wall = now_seconds() - start;
+    run->user = tv_seconds(usage.ru_utime);
+    run->sys = tv_seconds(usage.ru_stime);
+    run->maxrss = usage.ru_maxrss;
+    run->minflt = usage.ru_minflt;
+    run->majflt = usage.ru_majflt;
+    run->nvcsw = usage.ru_nvcsw;
+    run->nivcsw = usage.ru_nivcsw;
+    run->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return 0;
+}
 
-        // Obtener el tiempo de finalización
-        gettimeofday(&end, NULL);
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Percentil por rango mas cercano sobre un arreglo ordenado
+static double percentile(const double *sorted, int n, double pct) {
+    int rank = (int)(pct / 100.0 * n + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
 
-        // Calcular y mostrar el tiempo transcurrido
-        double elapsedTime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
-        printf("Elapsed time: %.5f seconds\n", elapsedTime);
+static Stats compute_stats(const Run *runs, int n, size_t offset) {
+    Stats st;
+    double *values = malloc(n * sizeof(double));
+    double sum = 0, sq = 0;
+
+    for (int i = 0; i < n; i++) {
+        values[i] = *(const double *)((const char *)&runs[i] + offset);
+        sum += values[i];
+    }
+    st.mean = sum / n;
+    for (int i = 0; i < n; i++) {
+        sq += (values[i] - st.mean) * (values[i] - st.mean);
     }
+    st.stddev = n > 1 ? sqrt(sq / (n - 1)) : 0; // Desviacion estandar muestral
 
-    return 0;
+    qsort(values, n, sizeof(double), compare_double);
+    st.min = values[0];
+    st.max = values[n - 1];
+    st.p50 = percentile(values, n, 50);
+    st.p95 = percentile(values, n, 95);
+    free(values);
+    return st;
+}
+
+static void print_text(FILE *out, const Run *runs, int n) {
+    if (n == 1) {
+        // Formato original para una sola ejecucion
+        fprintf(out, "Elapsed time: %.5f seconds\n", runs[0].wall);
+        fprintf(out, "User time: %.5f s, System time: %.5f s\n", runs[0].user, runs[0].sys);
+        fprintf(out, "Max RSS: %.0f KiB, Page faults: %.0f minor / %.0f major\n",
+                runs[0].maxrss, runs[0].minflt, runs[0].majflt);
+        fprintf(out, "Context switches: %.0f voluntary / %.0f involuntary\n", runs[0].nvcsw, runs[0].nivcsw);
+        if (num_metrics > NUM_BASE_METRICS) {
+            fprintf(out, "Peak (sampled): RSS %.0f KiB, CPU %.1f%%, %.0f threads\n",
+                    runs[0].peak_rss, runs[0].peak_cpu, runs[0].peak_threads);
+        }
+        fprintf(out, "Exit status: %d\n", runs[0].status);
+        return;
+    }
+
+    fprintf(out, "%d runs\n", n);
+    fprintf(out, "%-10s %12s %12s %12s %12s %12s %12s\n", "metric", "mean", "stddev", "min", "p50", "p95", "max");
+    for (size_t m = 0; m < num_metrics; m++) {
+        Stats st = compute_stats(runs, n, metrics[m].offset);
+        fprintf(out, "%-10s %12.5f %12.5f %12.5f %12.5f %12.5f %12.5f\n", metrics[m].name,
+                st.mean, st.stddev, st.min, st.p50, st.p95, st.max);
+    }
+    fprintf(out, "Exit status (last run): %d\n", runs[n - 1].status);
+}
+
+static void print_json(FILE *out, char **command, const Run *runs, int n, int warmup) {
+    fprintf(out, "{\"command\": [");
+    for (int i = 0; command[i] != NULL; i++) {
+        fprintf(out, "%s\"", i ? ", " : "");
+        for (const char *c = command[i]; *c; c++) {
+            if (*c == '"' || *c == '\\') fputc('\\', out);
+            fputc(*c, out);
+        }
+        fputc('"', out);
+    }
+    fprintf(out, "], \"runs\": %d, \"warmup\": %d, \"exit_status\": %d", n, warmup, runs[n - 1].status);
+
+    for (size_t m = 0; m < num_metrics; m++) {
+        Stats st = compute_stats(runs, n, metrics[m].offset);
+        fprintf(out, ", \"%s\": {\"mean\": %.6f, \"stddev\": %.6f, \"min\": %.6f, \"p50\": %.6f, \"p95\": %.6f, \"max\": %.6f}",
+                metrics[m].name, st.mean, st.stddev, st.min, st.p50, st.p95, st.max);
+    }
+
+    fprintf(out, ", \"samples\": [");
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "%s{", i ? ", " : "");
+        for (size_t m = 0; m < num_metrics; m++) {
+            fprintf(out, "%s\"%s\": %.6f", m ? ", " : "", metrics[m].name,
+                    *(const double *)((const char *)&runs[i] + metrics[m].offset));
+        }
+        fprintf(out, ", \"exit_status\": %d}", runs[i].status);
+    }
+    fprintf(out, "]}\n");
+}
+
+// Una fila por ejecucion, facil de agregar a una serie historica
+static void print_csv(FILE *out, const Run *runs, int n) {
+    fprintf(out, "run");
+    for (size_t m = 0; m < num_metrics; m++) fprintf(out, ",%s", metrics[m].name);
+    fprintf(out, ",exit_status\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "%d", i + 1);
+        for (size_t m = 0; m < num_metrics; m++) {
+            fprintf(out, ",%.6f", *(const double *)((const char *)&runs[i] + metrics[m].offset));
+        }
+        fprintf(out, ",%d\n", runs[i].status);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [-n ejecuciones] [-w calentamiento] [-f text|json|csv] [-o archivo]\n"
+                    "          [-s intervalo_ms [-T linea_de_tiempo]] <comando> [args...]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int runsWanted = 1;
+    int warmup = 0;
+    const char *format = "text";
+    const char *outPath = NULL;
+    const char *timelinePath = NULL;
+    int opt;
+
+    // '+' detiene getopt en el primer argumento que no es opcion (el comando)
+    while ((opt = getopt(argc, argv, "+n:w:f:o:s:T:h")) != -1) {
+        switch (opt) {
+        case 'n': runsWanted = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 'f': format = optarg; break;
+        case 'o': outPath = optarg; break;
+        case 's': sample_interval = atof(optarg) / 1000; break;
+        case 'T': timelinePath = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || runsWanted < 1 || warmup < 0 || sample_interval < 0 ||
+        (strcmp(format, "text") != 0 && strcmp(format, "json") != 0 && strcmp(format, "csv") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    char **command = &argv[optind];
+
+    if (sample_interval > 0) {
+        num_metrics = NUM_ALL_METRICS;
+        clock_ticks = sysconf(_SC_CLK_TCK);
+        page_kb = sysconf(_SC_PAGESIZE) / 1024;
+        timeline = stderr; // No se mezcla con la salida del comando
+        if (timelinePath != NULL && (timeline = fopen(timelinePath, "w")) == NULL) {
+            perror(timelinePath);
+            return 1;
+        }
+        fprintf(timeline, "run,t_s,rss_kb,cpu_pct,threads,procs\n");
+    }
+
+    // Ejecuciones de calentamiento: llenan caches, no se reportan
+    Run scratch;
+    for (int i = 0; i < warmup; i++) {
+        if (run_once(command, &scratch, 0) == -1) return 1;
+    }
+
+    Run *runs = malloc(runsWanted * sizeof(Run));
+    if (runs == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < runsWanted; i++) {
+        if (run_once(command, &runs[i], i + 1) == -1) return 1;
+    }
+
+    FILE *out = stdout;
+    if (outPath != NULL && (out = fopen(outPath, "w")) == NULL) {
+        perror(outPath);
+        return 1;
+    }
+    if (strcmp(format, "json") == 0) {
+        print_json(out, command, runs, runsWanted, warmup);
+    } else if (strcmp(format, "csv") == 0) {
+        print_csv(out, runs, runsWanted);
+    } else {
+        print_text(out, runs, runsWanted);
+    }
+    if (out != stdout) fclose(out);
+    if (timeline != NULL && timeline != stderr) fclose(timeline);
+
+    // Igual que time(1): el codigo de salida es el del comando medido
+    int status = runs[runsWanted - 1].status;
+    free(runs);
+    return status;
 }